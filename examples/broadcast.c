@@ -0,0 +1,121 @@
+/*
+ * Exercises the three policies of a broadcast channel for a subscriber
+ * which falls behind: overwrite (the default), CHANNEL_BROADCAST_BLOCK and
+ * CHANNEL_BROADCAST_DISCONNECT. Every channel keeps 2 messages.
+ */
+#include <mookry/coroutine.h>
+#include <mookry/extend_errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+int failures = 0;
+int send_ret = -2;
+double send_time;
+
+#define CHECK(cond, ...) do { \
+    printf("%s: ", (cond) ? "ok" : "FAIL"); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures += !(cond); \
+} while(0)
+
+/* Keeps up with everything sent on "/bc-block", reading every 20ms. */
+void fast_subscriber(void *arg){
+    char buf[8];
+    int64_t channel_id = channel_open_flags("/bc-block", 8, 2, CHANNEL_SUBSCRIBE);
+    while(1){
+        co_sleep(0.02);
+        while(channel_receive(channel_id, buf, sizeof(buf), 0) > 0){
+        }
+    }
+}
+
+/* Channel handles belong to the coroutine which opened them. */
+void blocked_sender(void *arg){
+    int64_t channel_id = channel_open_flags("/bc-block", 8, 2, CHANNEL_BROADCAST);
+    double start = co_time();
+    send_ret = channel_send(channel_id, arg, 2, -1);
+    send_time = co_time() - start;
+    channel_close(channel_id);
+}
+
+void test_overwrite(){
+    char buf[8];
+    int64_t sender = channel_open_flags("/bc-drop", 8, 2, CHANNEL_BROADCAST);
+    int64_t idle = channel_open_flags("/bc-drop", 8, 2, CHANNEL_SUBSCRIBE);
+    int ret;
+    channel_send(sender, "1", 2, 0);
+    channel_send(sender, "2", 2, 0);
+    ret = channel_send(sender, "3", 2, 0);
+    CHECK(ret == 2, "a sender never waits for a slow subscriber by default");
+    ret = channel_receive(idle, buf, sizeof(buf), 0);
+    CHECK(ret == 2 && !strcmp(buf, "2"), "the slow subscriber skips to the oldest message kept (%s)", buf);
+    channel_close(idle);
+    channel_close(sender);
+    channel_unlink("/bc-drop");
+}
+
+void test_block(){
+    char buf[8];
+    int64_t sender = channel_open_flags("/bc-block", 8, 2, CHANNEL_BROADCAST | CHANNEL_BROADCAST_BLOCK);
+    int64_t idle = channel_open_flags("/bc-block", 8, 2, CHANNEL_SUBSCRIBE);
+    double start;
+    int ret;
+    co_make(0, fast_subscriber, NULL);
+    co_yield();
+    channel_send(sender, "1", 2, -1);
+    channel_send(sender, "2", 2, -1);
+
+    start = co_time();
+    ret = channel_send(sender, "3", 2, 0.3);
+    CHECK(ret == 0 && co_time() - start >= 0.29, "a timed send waits out its timeout while the fast subscriber keeps up (%.2fs)", co_time() - start);
+
+    co_make(0, blocked_sender, "3");
+    co_sleep(0.2);
+    CHECK(send_ret == -2, "an untimed send still waits for the idle subscriber");
+    channel_receive(idle, buf, sizeof(buf), 0);
+    co_sleep(0.05);
+    CHECK(send_ret == 2, "the send goes through once the idle subscriber reads (%.2fs)", send_time);
+
+    send_ret = -2;
+    co_make(0, blocked_sender, "4");
+    co_sleep(0.2);
+    CHECK(send_ret == -2, "the idle subscriber is still 2 messages behind");
+    channel_close(idle);
+    co_sleep(0.05);
+    CHECK(send_ret == 2, "the send goes through once the idle subscriber closes");
+    channel_close(sender);
+    channel_unlink("/bc-block");
+}
+
+void test_disconnect(){
+    char buf[8];
+    int64_t sender = channel_open_flags("/bc-disconnect", 8, 2, CHANNEL_BROADCAST | CHANNEL_BROADCAST_DISCONNECT);
+    int64_t idle = channel_open_flags("/bc-disconnect", 8, 2, CHANNEL_SUBSCRIBE);
+    int ret;
+    channel_send(sender, "1", 2, 0);
+    channel_send(sender, "2", 2, 0);
+    channel_send(sender, "3", 2, 0);
+    ret = channel_receive(idle, buf, sizeof(buf), 0);
+    CHECK(ret < 0 && errno == ECHANNELDISCONNECTED, "the slow subscriber is disconnected");
+    ret = channel_send(sender, "4", 2, 0);
+    CHECK(ret == 2, "sending goes on without it");
+    channel_close(idle);
+    channel_close(sender);
+    channel_unlink("/bc-disconnect");
+}
+
+void co_start(void *arg){
+    test_overwrite();
+    test_block();
+    test_disconnect();
+    exit(failures ? 1 : 0);
+}
+
+int
+main(int argc, char **argv){
+    co_env(co_start, NULL);
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Exercises co_connect_timeout(), co_connect_any() and co_connect_fastopen()
+ * on loopback. A "dead" address is a listener whose accept queue is full:
+ * it never accepts, so SYNs sent to it go unanswered as on a black hole.
+ */
+#include <mookry/coroutine.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+int failures = 0;
+char received[64];
+
+#define CHECK(cond, ...) do { \
+    printf("%s: ", (cond) ? "ok" : "FAIL"); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures += !(cond); \
+} while(0)
+
+int listen_loopback(struct sockaddr_in *addr, int backlog){
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    listen(fd, backlog);
+    getsockname(fd, (struct sockaddr *)addr, &len);
+    return fd;
+}
+
+int listen_loopback6(struct sockaddr_in6 *addr, int backlog){
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = AF_INET6;
+    addr->sin6_addr = in6addr_loopback;
+    if(fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(fd, backlog) < 0){
+        return -1;
+    }
+    getsockname(fd, (struct sockaddr *)addr, &len);
+    return fd;
+}
+
+/* Connects until a SYN stays unanswered, leaving the accept queue full. */
+void fill_backlog(struct sockaddr *addr, socklen_t addrlen){
+    int fd;
+    while(1){
+        fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(co_connect_timeout(fd, addr, addrlen, 0.1) < 0){
+            close(fd);
+            return;
+        }
+    }
+}
+
+int count_fds(){
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+    while(readdir(dir)){
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+void server(void *arg){
+    int listen_fd = *(int *)arg, fd;
+    while((fd = co_accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+        co_read(fd, received, sizeof(received) - 1, 1);
+        close(fd);
+    }
+}
+
+void co_start(void *arg){
+    struct sockaddr_in dead, live;
+    struct sockaddr_in6 dead6;
+    struct addrinfo ai[2];
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    int live_fd, fd, ret, fds;
+    double start;
+    ssize_t n;
+
+    listen_loopback(&dead, 0);
+    fill_backlog((struct sockaddr *)&dead, sizeof(dead));
+    live_fd = listen_loopback(&live, 16);
+    co_make(0, server, &live_fd);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    start = co_time();
+    ret = co_connect_timeout(fd, (struct sockaddr *)&dead, sizeof(dead), 0.3);
+    CHECK(ret < 0 && errno == ETIMEDOUT && co_time() - start < 0.5, "co_connect_timeout gives up on a listener which never accepts (%.2fs, %s)", co_time() - start, strerror(errno));
+    close(fd);
+
+    memset(ai, 0, sizeof(ai));
+    ai[0].ai_family = AF_INET;
+    ai[0].ai_socktype = SOCK_STREAM;
+    ai[0].ai_addr = (struct sockaddr *)&dead;
+    ai[0].ai_addrlen = sizeof(dead);
+    ai[0].ai_next = &ai[1];
+    ai[1] = ai[0];
+    ai[1].ai_addr = (struct sockaddr *)&live;
+    ai[1].ai_next = NULL;
+    fds = count_fds();
+    start = co_time();
+    fd = co_connect_any(ai, 2);
+    /* The live address is only tried once the dead one had its 250ms head start. */
+    CHECK(fd >= 0 && co_time() - start >= 0.2 && co_time() - start < 1, "co_connect_any falls over to the live address after the stagger (%.2fs)", co_time() - start);
+    CHECK(count_fds() == fds + 1, "co_connect_any closes the attempt it abandoned");
+    close(fd);
+
+    /* Listed after the live IPv4 address, a dead IPv6 one still goes first. */
+    if(listen_loopback6(&dead6, 0) >= 0){
+        fill_backlog((struct sockaddr *)&dead6, sizeof(dead6));
+        ai[1].ai_family = AF_INET6;
+        ai[1].ai_addr = (struct sockaddr *)&dead6;
+        ai[1].ai_addrlen = sizeof(dead6);
+        ai[0].ai_addr = (struct sockaddr *)&live;
+        start = co_time();
+        fd = co_connect_any(ai, 2);
+        CHECK(fd >= 0 && co_time() - start >= 0.2 && co_time() - start < 1, "co_connect_any tries IPv6 first (%.2fs)", co_time() - start);
+        close(fd);
+    } else {
+        printf("skipped: no IPv6 loopback\n");
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(received, 0, sizeof(received));
+    n = co_connect_fastopen(fd, (struct sockaddr *)&live, sizeof(live), "hello", 5, 1);
+    co_sleep(0.1);
+    getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+    CHECK(n == 5 && !strcmp(received, "hello") && !(info.tcpi_options & TCPI_OPT_SYN_DATA), "co_connect_fastopen sends after the handshake when the server has no TCP_FASTOPEN");
+    close(fd);
+
+    exit(failures ? 1 : 0);
+}
+
+int
+main(int argc, char **argv){
+    co_env(co_start, NULL);
+    return 0;
+}
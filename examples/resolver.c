@@ -0,0 +1,263 @@
+/*
+ * Resolves names against a stub DNS server which runs in the same event
+ * loop on 127.0.0.1:53, and checks caching, coalescing, negative answers
+ * and the TCP fallback. Binding port 53 needs root or CAP_NET_BIND_SERVICE.
+ */
+#include <mookry/coroutine.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define T_A 1
+#define T_SOA 6
+#define T_AAAA 28
+
+struct stub_query {
+    int fd;
+    int tcp;
+    struct sockaddr_in peer;
+    int len;
+    unsigned char buf[512];
+};
+
+const char *stub_names[] = {"foo.test", "slow.test", "nx.test", "big.test"};
+int stub_udp_count[4][2], stub_tcp_count[4];
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    printf("%s: ", (cond) ? "ok" : "FAIL"); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures += !(cond); \
+} while(0)
+
+int put_rr(unsigned char *p, int type, uint32_t ttl, const void *rdata, int rdlen){
+    p[0] = 0xc0;
+    p[1] = 12;
+    p[2] = type >> 8;
+    p[3] = type;
+    p[4] = 0;
+    p[5] = 1;
+    p[6] = ttl >> 24;
+    p[7] = ttl >> 16;
+    p[8] = ttl >> 8;
+    p[9] = ttl;
+    p[10] = rdlen >> 8;
+    p[11] = rdlen;
+    memcpy(p + 12, rdata, rdlen);
+    return 12 + rdlen;
+}
+
+/*
+ * foo.test has two A and one AAAA with a 1 second TTL, slow.test one A,
+ * big.test 40 A which only fit over TCP, and every other name is NXDOMAIN
+ * with an SOA allowing it to be cached for a minute.
+ */
+int stub_answer(unsigned char *q, int qlen, int tcp, unsigned char *out){
+    char name[256];
+    int off = 12, n = 0, i, idx = -1, qtype, an = 0, ns = 0, rcode = 0, tc = 0, len;
+    unsigned char rdata[64];
+    while(off < qlen && q[off]){
+        memcpy(name + n, q + off + 1, q[off]);
+        n += q[off];
+        name[n++] = '.';
+        off += q[off] + 1;
+    }
+    name[n ? n - 1 : 0] = '\0';
+    qtype = (q[off + 1] << 8) | q[off + 2];
+    off += 5;
+    for(i = 0; i < 4; i++){
+        if(!strcmp(name, stub_names[i])){
+            idx = i;
+        }
+    }
+    if(idx >= 0 && tcp){
+        stub_tcp_count[idx]++;
+    } else if(idx >= 0){
+        stub_udp_count[idx][qtype == T_AAAA]++;
+    }
+    memcpy(out, q, off);
+    len = off;
+    if(idx == 0 && qtype == T_A){
+        inet_pton(AF_INET, "10.0.0.1", rdata);
+        len += put_rr(out + len, T_A, 1, rdata, 4);
+        inet_pton(AF_INET, "10.0.0.2", rdata);
+        len += put_rr(out + len, T_A, 1, rdata, 4);
+        an = 2;
+    } else if(idx == 0 && qtype == T_AAAA){
+        inet_pton(AF_INET6, "2001:db8::1", rdata);
+        len += put_rr(out + len, T_AAAA, 1, rdata, 16);
+        an = 1;
+    } else if(idx == 1 && qtype == T_A){
+        inet_pton(AF_INET, "10.0.0.3", rdata);
+        len += put_rr(out + len, T_A, 60, rdata, 4);
+        an = 1;
+    } else if(idx == 3 && qtype == T_A && !tcp){
+        tc = 1;
+    } else if(idx == 3 && qtype == T_A){
+        for(i = 0; i < 40; i++){
+            rdata[0] = 10;
+            rdata[1] = 1;
+            rdata[2] = 0;
+            rdata[3] = i;
+            len += put_rr(out + len, T_A, 60, rdata, 4);
+        }
+        an = 40;
+    } else {
+        /* mname ".", rname ".", then serial, refresh, retry, expire, minimum */
+        memset(rdata, 0, 22);
+        rdata[21] = 60;
+        len += put_rr(out + len, T_SOA, 60, rdata, 22);
+        ns = 1;
+        rcode = idx == 2 ? 3 : 0;
+    }
+    out[2] = 0x81 | (tc << 1);
+    out[3] = 0x80 | rcode;
+    out[4] = 0;
+    out[5] = 1;
+    out[6] = 0;
+    out[7] = an;
+    out[8] = 0;
+    out[9] = ns;
+    out[10] = out[11] = 0;
+    return len;
+}
+
+/* Answers late, so that concurrent lookups of one name overlap. */
+void stub_reply(void *arg){
+    struct stub_query *query = arg;
+    unsigned char out[2048];
+    int len;
+    co_sleep(0.05);
+    len = stub_answer(query->buf, query->len, query->tcp, out + 2);
+    if(query->tcp){
+        out[0] = len >> 8;
+        out[1] = len;
+        co_write(query->fd, out, len + 2, 1);
+        close(query->fd);
+    } else {
+        co_sendto(query->fd, out + 2, len, 0, (struct sockaddr *)&query->peer, sizeof(query->peer), 1);
+    }
+    free(query);
+}
+
+void stub_udp(void *arg){
+    int fd = *(int *)arg;
+    struct stub_query *query;
+    socklen_t peer_len;
+    while(1){
+        query = calloc(1, sizeof(struct stub_query));
+        peer_len = sizeof(query->peer);
+        query->fd = fd;
+        query->len = co_recvfrom(fd, query->buf, sizeof(query->buf), 0, (struct sockaddr *)&query->peer, &peer_len, -1);
+        if(query->len < 12){
+            free(query);
+            continue;
+        }
+        co_make(0, stub_reply, query);
+    }
+}
+
+void stub_tcp(void *arg){
+    int fd = *(int *)arg;
+    unsigned char hdr[2];
+    struct stub_query *query;
+    while(1){
+        query = calloc(1, sizeof(struct stub_query));
+        query->tcp = 1;
+        query->fd = co_accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+        if(query->fd < 0 || co_read(query->fd, hdr, 2, 1) != 2
+            || (query->len = co_read(query->fd, query->buf, (hdr[0] << 8) | hdr[1], 1)) < 12){
+            if(query->fd >= 0){
+                close(query->fd);
+            }
+            free(query);
+            continue;
+        }
+        co_make(0, stub_reply, query);
+    }
+}
+
+int count_results(const char *name, int family, int *ret){
+    struct addrinfo hints, *res, *ai;
+    int n = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    *ret = co_getaddrinfo(name, "80", &hints, &res);
+    if(*ret){
+        return 0;
+    }
+    for(ai = res; ai; ai = ai->ai_next){
+        n++;
+    }
+    co_freeaddrinfo(res);
+    return n;
+}
+
+void concurrent_lookup(void *arg){
+    int ret, *results = arg;
+    *results += count_results("slow.test", AF_INET, &ret);
+}
+
+void co_start(void *arg){
+    char resolv_conf[] = "/tmp/mookry-resolv-XXXXXX", hosts[] = "/tmp/mookry-hosts-XXXXXX";
+    struct sockaddr_in addr;
+    int udp_fd, tcp_fd, one = 1, i, n, ret, results = 0;
+    int fd = mkstemp(resolv_conf);
+    write(fd, "nameserver 127.0.0.1\noptions timeout:1 attempts:1\n", 51);
+    close(fd);
+    close(mkstemp(hosts));
+    co_set_resolv_conf(resolv_conf, hosts);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(53);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || bind(tcp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(tcp_fd, 16) < 0){
+        printf("skipped: can't serve 127.0.0.1:53: %s\n", strerror(errno));
+        unlink(resolv_conf);
+        unlink(hosts);
+        exit(0);
+    }
+    co_make(0, stub_udp, &udp_fd);
+    co_make(0, stub_tcp, &tcp_fd);
+
+    n = count_results("foo.test", AF_UNSPEC, &ret);
+    CHECK(n == 3, "foo.test gives 2 A and 1 AAAA (%d results, ret %d)", n, ret);
+    n = count_results("foo.test", AF_UNSPEC, &ret);
+    CHECK(n == 3 && stub_udp_count[0][0] == 1 && stub_udp_count[0][1] == 1, "foo.test again is served from the cache (%d A, %d AAAA queries)", stub_udp_count[0][0], stub_udp_count[0][1]);
+    co_sleep(1.2);
+    n = count_results("foo.test", AF_UNSPEC, &ret);
+    CHECK(n == 3 && stub_udp_count[0][0] == 2 && stub_udp_count[0][1] == 2, "foo.test is asked again once its TTL ran out");
+
+    for(i = 0; i < 10; i++){
+        co_make(0, concurrent_lookup, &results);
+    }
+    co_sleep(0.5);
+    CHECK(results == 10 && stub_udp_count[1][0] == 1, "10 concurrent lookups of slow.test share %d query", stub_udp_count[1][0]);
+
+    count_results("nx.test", AF_INET, &ret);
+    CHECK(ret == EAI_NONAME, "nx.test is NXDOMAIN (%s)", gai_strerror(ret));
+    count_results("nx.test", AF_INET, &ret);
+    CHECK(ret == EAI_NONAME && stub_udp_count[2][0] == 1, "nx.test again comes from the negative cache");
+
+    n = count_results("big.test", AF_INET, &ret);
+    /* The resolver keeps the first 16 addresses of an answer. */
+    CHECK(n == 16 && stub_udp_count[3][0] == 1 && stub_tcp_count[3] == 1, "big.test is truncated over UDP and retried over TCP (%d results)", n);
+
+    unlink(resolv_conf);
+    unlink(hosts);
+    exit(failures ? 1 : 0);
+}
+
+int
+main(int argc, char **argv){
+    co_env(co_start, NULL);
+    return 0;
+}
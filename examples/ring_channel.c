@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <mookry/coroutine.h>
+
+struct ring_channel *ring;
+
+void *worker(void *arg){
+    ring_channel_thread_send(ring, "hello", 6, -1);
+    return NULL;
+}
+
+void co_start(void *arg){
+    char buf[100];
+    ring_channel_receive(ring, buf, sizeof(buf), -1);
+    printf("receive data: %s\n", buf);
+}
+
+int
+main(int argc, char **argv){
+    pthread_t thread;
+    ring = ring_channel_create(100, 16);
+    pthread_create(&thread, NULL, worker, NULL);
+    co_env(co_start, NULL);
+    pthread_join(thread, NULL);
+    ring_channel_destroy(ring);
+    return 0;
+}
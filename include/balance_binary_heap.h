@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "list.h"
+#include "slab.h"
 
 struct balance_binary_heap_node {
     struct balance_binary_heap_node *parent;
@@ -22,6 +23,8 @@ struct balance_binary_heap_value {
 struct balance_binary_heap {
     struct balance_binary_heap_node *root;     
     int (*cmp_key)(const void *, const void *);
+    struct slab_cache node_cache;
+    struct slab_cache value_cache;
     struct balance_binary_heap_value* (*insert_value)(struct balance_binary_heap* heap, void *pointer);
     void (*delete_value)(struct balance_binary_heap* heap, struct balance_binary_heap_value *value);
     void (*heapify)(struct balance_binary_heap *heap, struct balance_binary_heap_value *value);
@@ -4,6 +4,13 @@
 #define CHANNEL_ID_HASH_SIZE 64
 #define CHANNEL_NAME_HASH_SIZE 64
 #define CHANNEL_NAME_SIZE   64
+#define CHANNEL_POOL_SHARED 0x01
+#define CHANNEL_POOL_BROADCAST 0x02
+#define CHANNEL_POOL_SUBSCRIBE 0x04
+#define CHANNEL_POOL_BROADCAST_BLOCK 0x08
+#define CHANNEL_POOL_BROADCAST_DISCONNECT 0x10
+
+struct ring_channel;
 
 struct channel_pool {
     int64_t source_id;
@@ -11,7 +18,7 @@ struct channel_pool {
     struct hlist_head name_hash[CHANNEL_NAME_HASH_SIZE];
     void (*init)(struct channel_pool *channel_pool);
     void (*destruct)(struct channel_pool *channel_pool);
-    int64_t (*open)(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg);
+    int64_t (*open)(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg, int flags);
     void (*close)(struct channel_pool *channel_pool, int64_t channel_id);
     void (*unlink)(struct channel_pool *channel_pool, char *name);
     ssize_t (*receive)(struct channel_pool *channel_pool, int64_t channel_id, char *msg_ptr, size_t msg_len);
@@ -20,6 +27,8 @@ struct channel_pool {
     int (*isfull)(struct channel_pool *channel_pool, int64_t channel_id);
     int (*getname)(struct channel_pool *channel_pool, int64_t channel_id, char *buf, size_t buf_len);
     int (*getmsgsize)(struct channel_pool *channel_pool, int64_t channel_id);
+    struct ring_channel *(*getring)(struct channel_pool *channel_pool, int64_t channel_id);
+    int (*getflags)(struct channel_pool *channel_pool, int64_t channel_id);
 };
 
 struct channel_pool *alloc_channel_pool();
@@ -4,11 +4,99 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <netdb.h>
 
 #define DEFAULT_COROUTINE_STACK_SIZE 2 * 1024 * 1024
+#define DEFAULT_COROUTINE_RUN_BUDGET 256
+#define CHANNEL_SHARED 0x01
+#define CHANNEL_BROADCAST 0x02
+#define CHANNEL_SUBSCRIBE 0x04
+#define CHANNEL_BROADCAST_BLOCK 0x08
+#define CHANNEL_BROADCAST_DISCONNECT 0x10
+
+#define CO_SELECT_RECEIVE 1
+#define CO_SELECT_SEND 2
+#define CO_SELECT_READ 3
+#define CO_SELECT_WRITE 4
+
+#define CO_PRIORITY_HIGH 0
+#define CO_PRIORITY_NORMAL 1
+#define CO_PRIORITY_LOW 2
+#define CO_PRIORITY_LEVELS 3
+
+#define CO_DISPATCH_STRICT 0
+#define CO_DISPATCH_WEIGHTED 1
+#define CO_DISPATCH_EDF 0x10
+
+#define CO_WAKEUP_DIRECT 0
+#define CO_WAKEUP_QUEUED 1
+
+#define CO_MEM_HUGEPAGE 0x01
+#define CO_MEM_HUGETLB 0x02
+#define CO_MEM_NUMA_LOCAL 0x04
+#define CO_MEM_POPULATE 0x08
+
+#define CO_KEYS_MAX 16
+
+#define CO_POST_CALLBACK 0x01
+
+struct ring_channel;
+struct co_mutex;
+struct co_cond;
+struct co_sem;
+struct co_waitgroup;
+struct co_group;
+struct co_pool;
+struct co_connpool;
+
+struct co_stack_stats {
+    uint64_t coroutines;
+    uint64_t reserved_bytes;
+    uint64_t resident_bytes;
+    uint64_t reclaimed_bytes;
+};
+
+struct co_slab_stats {
+    uint64_t in_use;
+    uint64_t free_objects;
+    uint64_t allocs;
+    uint64_t block_bytes;
+};
+
+struct co_connpool_stats {
+    uint64_t active;
+    uint64_t idle;
+    uint64_t connects;
+    uint64_t reuses;
+    uint64_t dead;
+};
+
+struct co_select_case {
+    int type;
+    int fd;
+    int64_t channel_id;
+    char *msg_ptr;
+    size_t msg_len;
+    ssize_t ret;
+};
 
 int co_env(void (*co_start)(void *), void *arg);
-int co_make(uint32_t stack_size, void(*routine)(void *), void *arg);
+int64_t co_make(uint32_t stack_size, void(*routine)(void *), void *arg);
+int64_t co_self();
+int co_in_coroutine();
+int co_join(int64_t co_id, double timeout);
+int co_cancel(int64_t co_id);
+int co_set_priority(int64_t co_id, int priority);
+int co_get_priority(int64_t co_id);
+int co_set_dispatch(int mode, const int *weights);
+double co_time();
+int co_set_deadline(double deadline);
+double co_get_deadline();
+struct co_group *co_group_create();
+int co_group_destroy(struct co_group *group);
+int64_t co_group_make(struct co_group *group, uint32_t stack_size, void(*routine)(void *), void *arg);
+void co_group_cancel(struct co_group *group);
+int co_group_join(struct co_group *group, double timeout);
 ssize_t co_write(int sockfd, const void *buf, size_t count, double timeout);
 ssize_t co_send(int sockfd, const void *buf, size_t len, int flags, double timeout);
 ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, double timeout);
@@ -18,9 +106,16 @@ ssize_t co_recv(int sockfd, void *buf, size_t len, int flags, double timeout);
 ssize_t co_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen, double timeout);
 ssize_t co_recvmsg(int sockfd, struct msghdr *msg, int flags, double timeout);
 int co_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+int co_connect_timeout(int sockfd, const struct sockaddr *addr, socklen_t addrlen, double timeout);
+int co_connect_any(const struct addrinfo *res, double timeout);
+ssize_t co_connect_fastopen(int sockfd, const struct sockaddr *addr, socklen_t addrlen, const void *buf, size_t len, double timeout);
 int co_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int co_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 void co_sleep(double seconds);
+void co_yield();
+int co_switch_to(int64_t co_id);
+void co_set_run_budget(int max_resumes, double max_seconds);
+int co_set_wakeup_mode(int mode);
 void co_add_signal(int signo, void(*handler)(int signo, void *arg), void *arg);
 void co_remove_signal(int signo);
 int channel_send(int64_t channel_id, const char *msg_ptr, size_t msg_len, double timeout);
@@ -28,5 +123,64 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 void channel_unlink(char *name);
 void channel_close(int64_t channel_id);
 int64_t channel_open(char *name, int msgsize, int maxmsg);
+int64_t channel_open_flags(char *name, int msgsize, int maxmsg, int flags);
+struct ring_channel *ring_channel_create(int msgsize, int maxmsg);
+void ring_channel_destroy(struct ring_channel *ring);
+void ring_channel_set_spin(struct ring_channel *ring, int spin);
+int ring_channel_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout);
+int ring_channel_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout);
+int ring_channel_thread_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout);
+int ring_channel_thread_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout);
+int co_select(struct co_select_case *cases, int ncases, double timeout);
+struct co_mutex *co_mutex_create();
+int co_mutex_destroy(struct co_mutex *mutex);
+int co_mutex_lock(struct co_mutex *mutex);
+int co_mutex_trylock(struct co_mutex *mutex);
+int co_mutex_unlock(struct co_mutex *mutex);
+struct co_cond *co_cond_create();
+int co_cond_destroy(struct co_cond *cond);
+int co_cond_wait(struct co_cond *cond, struct co_mutex *mutex, double timeout);
+void co_cond_signal(struct co_cond *cond);
+void co_cond_broadcast(struct co_cond *cond);
+struct co_sem *co_sem_create(int64_t value);
+int co_sem_destroy(struct co_sem *sem);
+int co_sem_wait(struct co_sem *sem, double timeout);
+void co_sem_post(struct co_sem *sem);
+struct co_waitgroup *co_waitgroup_create();
+int co_waitgroup_destroy(struct co_waitgroup *wg);
+int co_waitgroup_add(struct co_waitgroup *wg, int64_t delta);
+void co_waitgroup_done(struct co_waitgroup *wg);
+int co_waitgroup_wait(struct co_waitgroup *wg, double timeout);
+struct co_pool *co_pool_create(int workers, uint32_t stack_size);
+int co_pool_set_max_workers(struct co_pool *pool, int max_workers);
+int co_go(struct co_pool *pool, void (*routine)(void *), void *arg);
+void co_pool_destroy(struct co_pool *pool);
+int co_set_stack_reclaim(double idle_seconds);
+int co_get_stack_stats(struct co_stack_stats *stats);
+ssize_t co_stack_high_water(int64_t co_id);
+int co_set_stack_profile(int enable);
+int co_stack_profile_dump(int fd);
+int co_set_mem_placement(int flags);
+int co_get_slab_stats(struct co_slab_stats *stats);
+void *co_arena_alloc(size_t size);
+void co_arena_reset();
+int co_key_create(int *key, void (*destructor)(void *value));
+int co_key_delete(int key);
+void *co_getspecific(int key);
+int co_setspecific(int key, const void *value);
+void *co_run_blocking(void *(*fn)(void *arg), void *arg);
+int co_set_blocking_threads(int max_threads);
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int co_fsync(int fd);
+int co_post(void (*fn)(void *arg), void *arg, int flags);
+struct co_connpool *co_connpool_create(int max_idle, int max_active, double idle_timeout);
+int co_connpool_get(struct co_connpool *pool, const struct sockaddr *addr, socklen_t addrlen, double timeout);
+int co_connpool_put(struct co_connpool *pool, int fd, int reusable);
+int co_connpool_destroy(struct co_connpool *pool);
+int co_connpool_get_stats(struct co_connpool *pool, struct co_connpool_stats *stats);
+int co_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+void co_freeaddrinfo(struct addrinfo *res);
+int co_set_resolv_conf(const char *resolv_conf, const char *hosts);
 
 #endif
@@ -7,6 +7,7 @@
 #include "hlist.h"
 #include "list.h"
 #include "balance_binary_heap.h"
+#include "slab.h"
 
 #define EVENT_LOOP_TIMER_HASH_SIZE 8192 
 #define EVENT_LOOP_TIMER_HASH(timer_id) ((timer_id) & (EVENT_LOOP_TIMER_HASH_SIZE - 1))
@@ -27,6 +28,11 @@ struct event_loop {
     uint64_t source_id;
     uint64_t ready_loop_id;
     int defer_free;
+    int wakeup_pending;
+    size_t map_size;
+    int postfd;
+    uint32_t post_signaled;
+    struct event_loop_post_node *post_head;
     struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
     struct hlist_head fd_hash[EVENT_LOOP_FD_HASH_SIZE];
     struct hlist_head ready_fd_hash[EVENT_LOOP_READY_FD_HASH_SIZE];
@@ -36,6 +42,10 @@ struct event_loop {
     struct list_head signal_head;
     struct hlist_head timer_hash[EVENT_LOOP_TIMER_HASH_SIZE];
     struct balance_binary_heap *timer_heap;
+    struct slab_cache fd_node_cache;
+    struct slab_cache fd_waiter_cache;
+    struct slab_cache timer_node_cache;
+    struct slab_cache defer_node_cache;
     void (*init)(struct event_loop *ev);
     void (*destruct)(struct event_loop *ev);
     int (*accept)(struct event_loop *ev, int sockfd, struct sockaddr *addr, socklen_t *addrlen);
@@ -50,16 +60,18 @@ struct event_loop {
     ssize_t (*sendmsg)(struct event_loop *ev, int sockfd, const struct msghdr *msg, int flags);
     int (*poll)(struct event_loop *ev, int timeout);
     int (*add_reader)(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-    void (*remove_reader)(struct event_loop *ev, int fd);
+    void (*remove_reader)(struct event_loop *ev, int fd, void *arg);
     int (*add_writer)(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-    void (*remove_writer)(struct event_loop *ev, int fd);
+    void (*remove_writer)(struct event_loop *ev, int fd, void *arg);
     int (*add_reader_writer)(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-    void (*remove_reader_writer)(struct event_loop *ev, int fd);
+    void (*remove_reader_writer)(struct event_loop *ev, int fd, void *arg);
     int (*add_signal)(struct event_loop *ev, int signo, void(*callback)(struct event_loop *ev, int signo, void *arg), void *arg);
     void (*remove_signal)(struct event_loop *ev, int signo);
     int64_t (*add_timer)(struct event_loop *ev, struct timespec *timespec, int(*callback)(struct event_loop *ev, int64_t timer_id, void *arg), void *arg); 
     void (*remove_timer)(struct event_loop *ev, int64_t timer_id);
     int (*add_defer)(struct event_loop *ev, int(*callback)(struct event_loop *ev, void *arg), void *arg);
+    void (*wakeup)(struct event_loop *ev);
+    int (*post)(struct event_loop *ev, struct event_loop_post_node *post_node);
 };
 
 struct event_loop_timer_node {
@@ -88,10 +100,19 @@ struct event_loop_fd_node {
     int last_ready_flag;
     int fd;
     int event_type;
-    void (*reader_callback)(struct event_loop *ev, int fd, int event_type, void *arg);
-    void *reader_arg;
-    void (*writer_callback)(struct event_loop *ev, int fd, int event_type, void *arg);
-    void *writer_arg;
+    struct list_head readers;
+    struct list_head writers;
+};
+
+/*
+ * One callback parked on an fd, identified by its arg. Each direction
+ * keeps its waiters first come, first served, and a readiness edge goes
+ * to the first one only.
+ */
+struct event_loop_fd_waiter {
+    struct list_head node;
+    void (*callback)(struct event_loop *ev, int fd, int event_type, void *arg);
+    void *arg;
 };
 
 struct event_loop_defer_node {
@@ -100,7 +121,20 @@ struct event_loop_defer_node {
     void *arg;
 };
 
+/*
+ * Posted from any thread: pushed on a lock-free stack which the loop
+ * thread takes as a whole and runs in posting order. The node comes from
+ * malloc(), usually as the head of the poster's own struct, and the loop
+ * frees it once the callback returned, or at destruct if it never ran.
+ */
+struct event_loop_post_node {
+    struct event_loop_post_node *next;
+    void (*callback)(struct event_loop *ev, void *arg);
+    void *arg;
+};
+
 struct event_loop *alloc_event_loop();
+struct event_loop *alloc_event_loop_placed(int mem_flags);
 void free_event_loop(struct event_loop *ev);
 
 #endif
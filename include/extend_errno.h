@@ -3,6 +3,7 @@
 
 #define ECHANNELNAME -1000
 #define ECHANNELUNLINKED -1001
+#define ECHANNELDISCONNECTED -1002
 
 #endif
 
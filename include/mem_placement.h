@@ -0,0 +1,14 @@
+#ifndef  _MEM_PLACEMENT_H
+#define  _MEM_PLACEMENT_H
+
+#include <stddef.h>
+
+#define MEM_PLACEMENT_HUGEPAGE 0x01
+#define MEM_PLACEMENT_HUGETLB 0x02
+#define MEM_PLACEMENT_NUMA_LOCAL 0x04
+#define MEM_PLACEMENT_POPULATE 0x08
+#define MEM_PLACEMENT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+void *mem_placement_map(size_t *size, size_t guard, int flags);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef  _RING_CHANNEL_H
+#define  _RING_CHANNEL_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "list.h"
+
+#define RING_CHANNEL_CACHE_LINE 64
+#define RING_CHANNEL_DEFAULT_SPIN 128
+#define RING_CHANNEL_MAGIC 0x52494e47
+#define RING_CHANNEL_OPEN_TIMEOUT 1.0
+
+struct event_loop;
+
+struct ring_channel_slot {
+    uint64_t sequence;
+    uint32_t len;
+    char data[];
+};
+
+/*
+ * The part of a ring that producers and consumers share. It only holds
+ * offsets and counters, never pointers, so it can live in any mapping.
+ */
+struct ring_channel_shared {
+    uint32_t magic;
+    uint32_t msgsize;
+    uint32_t maxmsg;
+    uint32_t slot_size;
+    uint32_t mask;
+    char pad0[RING_CHANNEL_CACHE_LINE - 5 * sizeof(uint32_t)];
+    uint64_t enqueue_pos;
+    char pad1[RING_CHANNEL_CACHE_LINE - sizeof(uint64_t)];
+    uint64_t dequeue_pos;
+    char pad2[RING_CHANNEL_CACHE_LINE - sizeof(uint64_t)];
+    uint32_t seq;
+    uint32_t waiters;
+    char pad3[RING_CHANNEL_CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+struct ring_channel {
+    struct ring_channel_shared *shared;
+    size_t map_size;
+    int futex_private;
+    int spin;
+    int eventfd;
+    uint32_t signaled;
+    uint32_t co_waiters;
+    struct event_loop *ev;
+    struct list_head ev_node;
+    struct list_head receive_list;
+    struct list_head send_list;
+    int bridge_running;
+    uint32_t bridge_stop;
+    pthread_t bridge_thread;
+};
+
+struct ring_channel *ring_channel_create(int msgsize, int maxmsg);
+struct ring_channel *ring_channel_open_shared(const char *name, int msgsize, int maxmsg);
+void ring_channel_destroy(struct ring_channel *ring);
+int ring_channel_add_waiter(struct ring_channel *ring);
+void ring_channel_del_waiter(struct ring_channel *ring);
+void ring_channel_set_spin(struct ring_channel *ring, int spin);
+ssize_t ring_channel_try_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len);
+ssize_t ring_channel_try_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len);
+void ring_channel_notify(struct ring_channel *ring);
+int ring_channel_thread_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout);
+int ring_channel_thread_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef  _SLAB_H
+#define  _SLAB_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SLAB_DEFAULT_OBJECTS 64
+
+struct slab_block {
+    struct slab_block *next;
+};
+
+struct slab_free_object {
+    struct slab_free_object *next;
+};
+
+/*
+ * A single threaded free list allocator for fixed size objects. Objects
+ * are carved out of blocks of objects_per_block and go back to the free
+ * list when freed; blocks are only released by slab_cache_destroy().
+ */
+struct slab_cache {
+    size_t object_size;
+    size_t objects_per_block;
+    struct slab_free_object *free_list;
+    struct slab_block *blocks;
+    uint64_t in_use;
+    uint64_t free_objects;
+    uint64_t allocs;
+    uint64_t block_bytes;
+};
+
+void slab_cache_init(struct slab_cache *cache, size_t object_size, size_t objects_per_block);
+void slab_cache_destroy(struct slab_cache *cache);
+int slab_cache_grow(struct slab_cache *cache);
+
+static inline void *slab_alloc(struct slab_cache *cache){
+    struct slab_free_object *object;
+    if(!cache->free_list && slab_cache_grow(cache) < 0){
+        return NULL;
+    }
+    object = cache->free_list;
+    cache->free_list = object->next;
+    cache->free_objects -= 1;
+    cache->in_use += 1;
+    cache->allocs += 1;
+    memset(object, 0, cache->object_size);
+    return object;
+}
+
+static inline void slab_free(struct slab_cache *cache, void *ptr){
+    struct slab_free_object *object = ptr;
+    object->next = cache->free_list;
+    cache->free_list = object;
+    cache->free_objects += 1;
+    cache->in_use -= 1;
+}
+
+#endif
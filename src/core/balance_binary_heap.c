@@ -6,7 +6,6 @@ static struct balance_binary_heap_value* heap_insert_value(struct balance_binary
 static void heap_delete_value(struct balance_binary_heap *heap, struct balance_binary_heap_value *value);
 static void *heap_pop_value(struct balance_binary_heap *heap);
 static void *heap_peek_value(struct balance_binary_heap *heap);
-static void free_tree(struct balance_binary_heap_node *root);
 static void heap_heapify(struct balance_binary_heap *heap, struct balance_binary_heap_value *value);
 
 struct balance_binary_heap *alloc_heap(int (*cmp_key)(const void *, const void *)){
@@ -16,6 +15,8 @@ struct balance_binary_heap *alloc_heap(int (*cmp_key)(const void *, const void *
     }
     heap->root = NULL;
     heap->cmp_key = cmp_key;
+    slab_cache_init(&(heap->node_cache), sizeof(struct balance_binary_heap_node), SLAB_DEFAULT_OBJECTS);
+    slab_cache_init(&(heap->value_cache), sizeof(struct balance_binary_heap_value), SLAB_DEFAULT_OBJECTS);
     heap->insert_value = heap_insert_value;
     heap->delete_value = heap_delete_value;
     heap->pop_value = heap_pop_value;
@@ -25,31 +26,19 @@ struct balance_binary_heap *alloc_heap(int (*cmp_key)(const void *, const void *
 }
 
 void free_heap(struct balance_binary_heap *heap){
-    if(heap->root){
-        free_tree(heap->root);
-    }
+    slab_cache_destroy(&(heap->node_cache));
+    slab_cache_destroy(&(heap->value_cache));
     free(heap);
 }
 
-static void free_tree(struct balance_binary_heap_node *root){
-    if(root->left){
-        free_tree(root->left);
-    }
-    if(root->right){
-        free_tree(root->right);
-    }
-    free(root->value);
-    free(root);
-}
-
 static struct balance_binary_heap_value* heap_insert_value(struct balance_binary_heap *heap, void *pointer) {
-    struct balance_binary_heap_node* node = calloc(1, sizeof(struct balance_binary_heap_node));
+    struct balance_binary_heap_node* node = slab_alloc(&(heap->node_cache));
     if(!node){
         return NULL;
     }
-    struct balance_binary_heap_value* value = calloc(1, sizeof(struct balance_binary_heap_value));
+    struct balance_binary_heap_value* value = slab_alloc(&(heap->value_cache));
     if(!value){
-        free(node);
+        slab_free(&(heap->node_cache), node);
 	return NULL;
     }
     value->pointer = pointer;
@@ -206,8 +195,8 @@ static void heap_delete_value(struct balance_binary_heap *heap, struct balance_b
     }
     parent_node = delete_node->parent;
     delete_value = delete_node->value;
-    free(delete_node);
-    free(value);
+    slab_free(&(heap->node_cache), delete_node);
+    slab_free(&(heap->value_cache), value);
     if(!parent_node){
         heap->root = NULL;
 	return;
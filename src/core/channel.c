@@ -1,3 +1,4 @@
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include "hlist.h"
 #include "list.h"
 #include "channel.h"
+#include "ring_channel.h"
 #include "extend_errno.h"
 
 struct channel_pool *alloc_channel_pool();
@@ -13,7 +15,7 @@ void free_channel_pool(struct channel_pool *channel_pool);
 static inline uint32_t cal_name_hash(char *name, int len);
 static void channel_pool_init(struct channel_pool *channel_pool);
 static void channel_pool_destruct(struct channel_pool *channel_pool);
-static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg);
+static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg, int flags);
 static void channel_pool_close(struct channel_pool *channel_pool, int64_t channel_id);
 static void channel_pool_unlink(struct channel_pool *channel_pool, char *name);
 static ssize_t channel_pool_receive(struct channel_pool *channel_pool, int64_t channel_id, char *msg_ptr, size_t msg_len);
@@ -22,6 +24,8 @@ static int channel_pool_isempty(struct channel_pool *channel_pool, int64_t chann
 static int channel_pool_isfull(struct channel_pool *channel_pool, int64_t channel_id);
 static int channel_pool_getname(struct channel_pool *channel_pool, int64_t channel_id, char *buf, size_t buf_len);
 static int channel_pool_getmsgsize(struct channel_pool *channel_pool, int64_t channel_id);
+static struct ring_channel *channel_pool_getring(struct channel_pool *channel_pool, int64_t channel_id);
+static int channel_pool_getflags(struct channel_pool *channel_pool, int64_t channel_id);
 
 struct channel {
     struct hlist_node name_node;
@@ -32,6 +36,12 @@ struct channel {
     int msgsize;
     int maxmsg;
     int curmsgs;
+    struct ring_channel *ring;
+    int flags;
+    char *slots;
+    int slot_size;
+    uint64_t head;
+    struct list_head subscribers;
 };
 
 struct channel_data {
@@ -42,12 +52,35 @@ struct channel_data {
     int data_len;
 };
 
+struct broadcast_slot {
+    int data_len;
+    char data[];
+};
+
 struct id_name_node {
     struct hlist_node id_node;
     int64_t id;
     struct channel *channel;
+    struct list_head subscriber_node;
+    uint64_t cursor;
 };
 
+static void free_channel(struct channel *channel);
+static inline struct broadcast_slot *broadcast_slot(struct channel *channel, uint64_t seq);
+static inline int broadcast_lagging(struct channel *channel, struct id_name_node *id_name_node);
+
+static inline struct broadcast_slot *broadcast_slot(struct channel *channel, uint64_t seq){
+    return (struct broadcast_slot *)(channel->slots + (seq % channel->maxmsg) * channel->slot_size);
+}
+
+/*
+ * Every message is stored once; a subscriber whose cursor fell more than
+ * maxmsg behind the head has had unread messages overwritten.
+ */
+static inline int broadcast_lagging(struct channel *channel, struct id_name_node *id_name_node){
+    return channel->head - id_name_node->cursor > channel->maxmsg;
+}
+
 static inline uint32_t cal_name_hash(char *name, int len){
     uint32_t ret = 0;
     int i;
@@ -73,6 +106,8 @@ struct channel_pool *alloc_channel_pool(){
     channel_pool->isfull = channel_pool_isfull;
     channel_pool->getname = channel_pool_getname;
     channel_pool->getmsgsize = channel_pool_getmsgsize;
+    channel_pool->getring = channel_pool_getring;
+    channel_pool->getflags = channel_pool_getflags;
     channel_pool->init(channel_pool);
     return channel_pool;
 }
@@ -93,13 +128,24 @@ static void channel_pool_init(struct channel_pool *channel_pool){
     }
 }
 
+static void free_channel(struct channel *channel){
+    struct channel_data *cur_channel_data, *next_channel_data;
+    list_for_each_entry_safe(cur_channel_data, next_channel_data, &(channel->list_head), data_node) {
+        free(cur_channel_data->mem_base);
+    }
+    if(channel->ring){
+        ring_channel_destroy(channel->ring);
+    }
+    free(channel->slots);
+    free(channel);
+}
+
 static void channel_pool_destruct(struct channel_pool *channel_pool){
     int i;
     struct hlist_head *head;
     struct hlist_node *cur, *next;
     struct id_name_node *id_name_node;
     struct channel *channel;
-    struct channel_data *cur_channel_data, *next_channel_data;
     for(i=0; i < CHANNEL_ID_HASH_SIZE; i++){
         head = &channel_pool->id_hash[i];
         hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
@@ -109,15 +155,12 @@ static void channel_pool_destruct(struct channel_pool *channel_pool){
     for(i=0; i < CHANNEL_NAME_HASH_SIZE; i++){
         head = &channel_pool->name_hash[i];
         hlist_for_each_entry_safe(channel, cur, next, head, name_node){
-	    list_for_each_entry_safe(cur_channel_data, next_channel_data, &(channel->list_head), data_node) {
-                free(cur_channel_data->mem_base);
-            }
-            free(channel);
+            free_channel(channel);
         }
     }
 }
 
-static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg){
+static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name, int msgsize, int maxmsg, int flags){
     struct channel *channel, *find_channel = NULL;
     struct hlist_node *cur, *next;
     if(strlen(name) > CHANNEL_NAME_SIZE){
@@ -136,7 +179,32 @@ static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name,
 	}
     }
     if(!find_channel){
+        if((flags & CHANNEL_POOL_SHARED) && (flags & CHANNEL_POOL_BROADCAST)){
+            errno = EINVAL;
+            return -1;
+        }
         find_channel = calloc(1, sizeof(struct channel));
+        if(!find_channel){
+            return -1;
+        }
+        INIT_LIST_HEAD(&(find_channel->subscribers));
+        if(flags & CHANNEL_POOL_BROADCAST){
+            find_channel->slot_size = (sizeof(struct broadcast_slot) + msgsize + sizeof(int) - 1) & ~(sizeof(int) - 1);
+            find_channel->slots = malloc((size_t)find_channel->slot_size * maxmsg);
+            if(!find_channel->slots){
+                free(find_channel);
+                return -1;
+            }
+        }
+        if(flags & CHANNEL_POOL_SHARED){
+            find_channel->ring = ring_channel_open_shared(name, msgsize, maxmsg);
+            if(!find_channel->ring){
+                free(find_channel);
+                return -1;
+            }
+            msgsize = find_channel->ring->shared->msgsize;
+            maxmsg = find_channel->ring->shared->maxmsg;
+        }
         strcpy(find_channel->name, name);
         INIT_LIST_HEAD(&(find_channel->list_head));
         find_channel->msgsize = msgsize;
@@ -144,11 +212,20 @@ static int64_t channel_pool_open(struct channel_pool *channel_pool, char *name,
         find_channel->curmsgs = 0;
         find_channel->unlinked = 0;
         find_channel->refcnt = 0;
+        find_channel->flags = flags & (CHANNEL_POOL_SHARED | CHANNEL_POOL_BROADCAST | CHANNEL_POOL_BROADCAST_BLOCK | CHANNEL_POOL_BROADCAST_DISCONNECT);
         hlist_add_head(&(find_channel->name_node), head);
     }
     struct id_name_node *id_name_node = calloc(1, sizeof(struct id_name_node));
+    if(!id_name_node){
+        return -1;
+    }
     id_name_node->id = channel_pool->source_id++;
     id_name_node->channel = find_channel;
+    INIT_LIST_HEAD(&(id_name_node->subscriber_node));
+    if(find_channel->slots && (flags & CHANNEL_POOL_SUBSCRIBE)){
+        id_name_node->cursor = find_channel->head;
+        list_add_before(&(id_name_node->subscriber_node), &(find_channel->subscribers));
+    }
     find_channel->refcnt++;
     hlist_add_head(&(id_name_node->id_node), &(channel_pool->id_hash[id_name_node->id & (CHANNEL_ID_HASH_SIZE - 1)]));
     return id_name_node->id;
@@ -159,20 +236,19 @@ static void channel_pool_close(struct channel_pool *channel_pool, int64_t channe
     struct hlist_node *cur, *next;
     struct id_name_node *id_name_node;
     struct channel *channel;
-    struct channel_data *cur_channel_data, *next_channel_data;
     head = &channel_pool->id_hash[channel_id & (CHANNEL_ID_HASH_SIZE - 1)];
     hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
         if(channel_id == id_name_node->id) {
 	    hlist_del(&(id_name_node->id_node));
             channel = id_name_node->channel;
+	    if(!list_empty(&(id_name_node->subscriber_node))){
+	        list_del(&(id_name_node->subscriber_node));
+	    }
 	    free(id_name_node);
             channel->refcnt--;
 	    if(!channel->refcnt && channel->unlinked){
-	        list_for_each_entry_safe(cur_channel_data, next_channel_data, &(channel->list_head), data_node) {
-                    free(cur_channel_data->mem_base);
-                }
 		hlist_del(&(channel->name_node));
-                free(channel);
+                free_channel(channel);
 	    }
 	    return;
 	}
@@ -181,17 +257,16 @@ static void channel_pool_close(struct channel_pool *channel_pool, int64_t channe
 
 static void channel_pool_unlink(struct channel_pool *channel_pool, char *name){
     struct channel *channel, *find_channel = NULL;
-    struct channel_data *cur_channel_data, *next_channel_data;
     struct hlist_node *cur, *next;
     struct hlist_head *head = &(channel_pool->name_hash[cal_name_hash(name, strlen(name))]);
     hlist_for_each_entry_safe(channel, cur, next, head, name_node){
         if(strcmp(channel->name, name) == 0){
+	    if(channel->ring){
+                shm_unlink(channel->name);
+	    }
 	    if(!channel->refcnt){
-	        list_for_each_entry_safe(cur_channel_data, next_channel_data, &(channel->list_head), data_node) {
-                    free(cur_channel_data->mem_base);
-                }
 		hlist_del(&(channel->name_node));
-                free(channel);
+                free_channel(channel);
 	    } else {
 	        channel->unlinked = 1;
 	    }
@@ -211,10 +286,39 @@ static ssize_t channel_pool_receive(struct channel_pool *channel_pool, int64_t c
     hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
         if(channel_id == id_name_node->id) {
             channel = id_name_node->channel;
+	    if(channel->ring){
+	        if((data_len = ring_channel_try_receive(channel->ring, msg_ptr, msg_len)) >= 0){
+                    ring_channel_notify(channel->ring);
+		}
+		return data_len;
+	    }
 	    if(msg_len < channel->msgsize){
 	        errno = EMSGSIZE;
                 return -1;
 	    }
+	    if(channel->slots){
+	        struct broadcast_slot *slot;
+	        if(list_empty(&(id_name_node->subscriber_node))){
+		    errno = (id_name_node->cursor == UINT64_MAX) ? ECHANNELDISCONNECTED : EBADF;
+                    return -1;
+		}
+		if(broadcast_lagging(channel, id_name_node)){
+		    if(channel->flags & CHANNEL_POOL_BROADCAST_DISCONNECT){
+		        list_del(&(id_name_node->subscriber_node));
+		        id_name_node->cursor = UINT64_MAX;
+		        errno = ECHANNELDISCONNECTED;
+                        return -1;
+		    }
+		    id_name_node->cursor = channel->head - channel->maxmsg;
+		}
+		if(id_name_node->cursor == channel->head){
+	            errno = EAGAIN;
+                    return -1;
+		}
+		slot = broadcast_slot(channel, id_name_node->cursor++);
+		memcpy(msg_ptr, slot->data, slot->data_len);
+		return slot->data_len;
+	    }
 	    if(!channel->curmsgs){
 	        errno = EAGAIN;
                 return -1;
@@ -241,10 +345,27 @@ static ssize_t channel_pool_send(struct channel_pool *channel_pool, int64_t chan
     hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
         if(channel_id == id_name_node->id) {
             channel = id_name_node->channel;
+	    if(channel->ring){
+	        if((mem_len = ring_channel_try_send(channel->ring, msg_ptr, msg_len)) >= 0){
+                    ring_channel_notify(channel->ring);
+		}
+		return mem_len;
+	    }
 	    if(msg_len > channel->msgsize){
 	        errno = EMSGSIZE;
                 return -1;
 	    }
+	    if(channel->slots){
+	        struct broadcast_slot *slot;
+		if(channel_pool_isfull(channel_pool, channel_id)){
+	            errno = EAGAIN;
+                    return -1;
+		}
+		slot = broadcast_slot(channel, channel->head++);
+		slot->data_len = msg_len;
+		memcpy(slot->data, msg_ptr, msg_len);
+		return msg_len;
+	    }
 	    if(channel->curmsgs >= channel->maxmsg){
 	        errno = EAGAIN;
                 return -1;
@@ -272,6 +393,12 @@ static int channel_pool_isempty(struct channel_pool *channel_pool, int64_t chann
     hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
         if(channel_id == id_name_node->id) {
             channel = id_name_node->channel;
+	    if(channel->ring){
+	        return __atomic_load_n(&(channel->ring->shared->enqueue_pos), __ATOMIC_ACQUIRE) == __atomic_load_n(&(channel->ring->shared->dequeue_pos), __ATOMIC_ACQUIRE);
+	    }
+	    if(channel->slots){
+	        return !list_empty(&(id_name_node->subscriber_node)) && id_name_node->cursor == channel->head;
+	    }
 	    return !channel->curmsgs;
 	}
     }
@@ -286,6 +413,21 @@ static int channel_pool_isfull(struct channel_pool *channel_pool, int64_t channe
     hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
         if(channel_id == id_name_node->id) {
             channel = id_name_node->channel;
+	    if(channel->ring){
+	        return __atomic_load_n(&(channel->ring->shared->enqueue_pos), __ATOMIC_ACQUIRE) - __atomic_load_n(&(channel->ring->shared->dequeue_pos), __ATOMIC_ACQUIRE) >= channel->ring->shared->maxmsg;
+	    }
+	    if(channel->slots){
+	        struct id_name_node *subscriber;
+	        if(!(channel->flags & CHANNEL_POOL_BROADCAST_BLOCK)){
+		    return 0;
+		}
+		list_for_each_entry(subscriber, &(channel->subscribers), subscriber_node){
+		    if(channel->head - subscriber->cursor >= channel->maxmsg){
+		        return 1;
+		    }
+		}
+		return 0;
+	    }
 	    if(channel->curmsgs >= channel->maxmsg){
                 return 1;
 	    } else {
@@ -331,3 +473,30 @@ static int channel_pool_getmsgsize(struct channel_pool *channel_pool, int64_t ch
     errno = EINVAL;
     return -1;
 }
+
+static struct ring_channel *channel_pool_getring(struct channel_pool *channel_pool, int64_t channel_id){
+    struct hlist_head *head;
+    struct hlist_node *cur, *next;
+    struct id_name_node *id_name_node;
+    head = &channel_pool->id_hash[channel_id & (CHANNEL_ID_HASH_SIZE - 1)];
+    hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
+        if(channel_id == id_name_node->id) {
+	    return id_name_node->channel->ring;
+	}
+    }
+    return NULL;
+}
+
+static int channel_pool_getflags(struct channel_pool *channel_pool, int64_t channel_id){
+    struct hlist_head *head;
+    struct hlist_node *cur, *next;
+    struct id_name_node *id_name_node;
+    head = &channel_pool->id_hash[channel_id & (CHANNEL_ID_HASH_SIZE - 1)];
+    hlist_for_each_entry_safe(id_name_node, cur, next, head, id_node){
+        if(channel_id == id_name_node->id) {
+	    return id_name_node->channel->flags;
+	}
+    }
+    errno = EINVAL;
+    return -1;
+}
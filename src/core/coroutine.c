@@ -1,19 +1,41 @@
 #define _GNU_SOURCE
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <time.h>
 #include <errno.h>
 #include <assert.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include "coroutine.h"
 #include "event_loop.h"
 #include "list.h"
 #include "channel.h"
+#include "ring_channel.h"
+#include "mem_placement.h"
 
 #define COROUTINE_CHANNEL_HASH_SIZE 64
 #define WAITING_COROUTINE_HASH_SIZE 64
+#define COROUTINE_HASH_SIZE 256
+#define STACK_MINCORE_CHUNK 256
+#define STACK_CANARY 0xa5
+#define STACK_CANARY_WORD 0xa5a5a5a5a5a5a5a5ULL
+#define STACK_REPAINT_MARGIN 1024
+#define STACK_PROFILE_BUCKETS 10
+#define STACK_PROFILE_MIN_BUCKET 4096
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_MAX_FREE_CHUNKS 256
+#define KEY_DESTRUCTOR_ROUNDS 4
+#define DEFAULT_BLOCKING_THREADS 8
+#define CONNECT_ATTEMPT_DELAY 0.25
+#define CONNPOOL_HASH_SIZE 64
+#define CONNPOOL_SWEEP_INTERVAL 1.0
 
 struct coroutine {
     struct list_head list_node;
@@ -26,7 +48,78 @@ struct coroutine {
     struct timespec resume_time;
     void *mem_base;
     int mem_size;
-    struct hlist_head channels[COROUTINE_CHANNEL_HASH_SIZE];
+    struct hlist_head *channels;
+    void *specific[CO_KEYS_MAX];
+    int64_t id;
+    struct hlist_node hash_node;
+    int interrupted;
+    int priority;
+    double deadline;
+    int64_t deadline_timer_id;
+    double parked_at;
+    int stack_reclaimed;
+    int stack_profiled;
+    struct arena_chunk *arena;
+    struct list_head joiners;
+    struct co_group *group;
+    struct list_head group_node;
+};
+
+struct blocking_task {
+    struct list_head node;
+    void *(*fn)(void *arg);
+    void *arg;
+    void *result;
+    int err;
+    int done;
+    struct coroutine *coroutine;
+};
+
+/*
+ * Worker threads shared by all co_run_blocking() callers. Finished tasks
+ * are handed back to the loop thread through done and the eventfd.
+ */
+struct blocking_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t exit_cond;
+    struct list_head tasks;
+    struct list_head done;
+    int threads;
+    int idle_threads;
+    int max_threads;
+    int stopping;
+    int eventfd;
+};
+
+struct post_task {
+    struct event_loop_post_node post_node;
+    void (*fn)(void *arg);
+    void *arg;
+    int flags;
+};
+
+struct blocking_io {
+    int fd;
+    void *buf;
+    size_t count;
+    off_t offset;
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct stack_profile {
+    struct list_head node;
+    void (*routine)(void *arg);
+    uint64_t count;
+    uint64_t total_used;
+    size_t max_used;
+    uint64_t buckets[STACK_PROFILE_BUCKETS];
 };
 
 struct channel_node {
@@ -46,6 +139,100 @@ struct receive_send_list_node {
     struct coroutine *coroutine;
 };
 
+struct timeout_node {
+    struct coroutine *coroutine;
+    int fired;
+};
+
+struct select_node {
+    struct receive_send_list_node list_node;
+    struct waiting_node *waiting_node;
+    struct ring_channel *ring;
+};
+
+struct co_waiter {
+    struct list_head node;
+    struct coroutine *coroutine;
+    int woken;
+};
+
+struct co_mutex {
+    struct coroutine *owner;
+    struct list_head waiters;
+};
+
+struct co_cond {
+    struct list_head waiters;
+};
+
+struct co_sem {
+    int64_t value;
+    struct list_head waiters;
+};
+
+struct co_waitgroup {
+    int64_t count;
+    struct list_head waiters;
+};
+
+struct co_group {
+    struct list_head children;
+    struct list_head waiters;
+};
+
+struct co_pool_task {
+    struct list_head node;
+    void (*routine)(void *arg);
+    void *arg;
+};
+
+struct co_pool {
+    uint32_t stack_size;
+    int workers;
+    int max_workers;
+    int closing;
+    struct list_head tasks;
+    struct list_head free_tasks;
+    struct list_head idle_workers;
+};
+
+struct connpool_dest {
+    struct hlist_node node;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct list_head idle;
+    struct list_head waiters;
+    int active;
+};
+
+/*
+ * Every connection of the pool, checked out or idle. An idle one sits on
+ * the idle list of its destination and on the LRU of the pool, most
+ * recently used first, with a reader registered to notice the peer
+ * closing it.
+ */
+struct connpool_conn {
+    struct hlist_node node;
+    struct list_head idle_node;
+    struct list_head lru_node;
+    struct co_connpool *pool;
+    struct connpool_dest *dest;
+    int fd;
+    int idle;
+    double idle_since;
+};
+
+struct co_connpool {
+    struct hlist_head dests[CONNPOOL_HASH_SIZE];
+    struct hlist_head conns[CONNPOOL_HASH_SIZE];
+    struct list_head lru;
+    int max_idle;
+    int max_active;
+    double idle_timeout;
+    int64_t sweep_timer_id;
+    struct co_connpool_stats stats;
+};
+
 struct waiting_node {
     struct hlist_node node;
     char name[CHANNEL_NAME_SIZE+1];
@@ -58,19 +245,90 @@ struct channel_pool *main_channel_pool;
 struct coroutine  main_coroutine;
 struct coroutine  *cur_coroutine = &main_coroutine;
 struct hlist_head waiting_coroutine_hash[WAITING_COROUTINE_HASH_SIZE];
+struct hlist_head coroutine_hash[COROUTINE_HASH_SIZE];
+int64_t next_coroutine_id = 1;
 
 uint64_t coroutine_count = 0;
-LIST_HEAD(ready_co_head);
+struct list_head ready_co_heads[CO_PRIORITY_LEVELS];
+int dispatch_mode = CO_DISPATCH_STRICT;
+int dispatch_edf = 0;
+int dispatch_weights[CO_PRIORITY_LEVELS];
+int dispatch_credits[CO_PRIORITY_LEVELS];
+int run_budget = DEFAULT_COROUTINE_RUN_BUDGET;
+double run_budget_time = 0;
+int run_resumed;
+double run_started;
+int wakeup_mode = CO_WAKEUP_DIRECT;
+double stack_reclaim_idle = 0;
+int64_t stack_reclaim_timer_id = 0;
+uint64_t stack_reclaimed_bytes = 0;
+int stack_profile_enabled = 0;
+int mem_placement_flags = 0;
+struct arena_chunk *arena_free_chunks = NULL;
+int arena_free_chunk_count = 0;
+int key_in_use[CO_KEYS_MAX];
+void (*key_destructors[CO_KEYS_MAX])(void *value);
+struct hlist_head empty_channel_head;
+pthread_t loop_thread;
+int post_closing = 0;
+int post_inflight = 0;
+struct blocking_pool blocking_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .exit_cond = PTHREAD_COND_INITIALIZER,
+    .max_threads = DEFAULT_BLOCKING_THREADS,
+    .eventfd = -1,
+};
+LIST_HEAD(stack_profiles);
+LIST_HEAD(ring_channel_head);
 
 void *make_fcontext(void *sp, int size, void(*routine)(struct coroutine *coroutine));
 void *jump_fcontext(void **old_sp, void *new_sp, struct coroutine *coroutine, int preserve_fpu);
 static inline void routine_start(struct coroutine *coroutine);
+static void close_coroutine_channels(struct coroutine *coroutine);
+static inline struct hlist_head *coroutine_channel_head(struct coroutine *coroutine, int64_t channel_id);
+static void run_key_destructors(struct coroutine *coroutine);
+static size_t stack_resident_bytes(char *start, char *end, char **lowest);
+static void reclaim_stack(struct coroutine *coroutine);
+static int stack_reclaim_callback(struct event_loop *ev, int64_t timer_id, void *arg);
+static int arm_stack_reclaim();
+static size_t stack_usage(struct coroutine *coroutine);
+static void repaint_stack(struct coroutine *coroutine, size_t used);
+static void record_stack_usage(void (*routine)(void *), size_t used);
+static void pool_worker(void *pool);
+static void free_pool(struct co_pool *pool);
+static int64_t make_coroutine(uint32_t stack_size, void(*routine)(void *), void *arg, struct co_group *group);
+static struct coroutine *find_coroutine(int64_t co_id);
+static void cancel_coroutine(struct coroutine *coroutine);
+static inline int coroutine_interrupted();
+static int deadline_callback(struct event_loop *ev, int64_t timer_id, void *coroutine);
+static inline double call_timeout(double timeout);
 static inline int defer_destroy_coroutine(struct event_loop *ev, void *coroutine);
 static inline void destroy_coroutine(struct coroutine *coroutine);
 static inline void resume_coroutine(struct coroutine *coroutine);
 static inline void yield_coroutine();
 static inline void reader_writer_callback(struct event_loop *ev, int fd, int event_type, void *coroutine);
 static inline int sleep_callback(struct event_loop *ev, int64_t timer_id, void *coroutine);
+static inline int timeout_callback(struct event_loop *ev, int64_t timer_id, void *timeout_node);
+static inline int64_t add_timeout(struct timeout_node *timeout_node, double timeout);
+static void ring_channel_callback(struct event_loop *ev, int fd, int event_type, void *ring);
+static int ring_channel_register(struct ring_channel *ring);
+static int channel_is_open(int64_t channel_id);
+static void wake_channel_waiter(int64_t channel_id, int type);
+static int select_ready(struct co_select_case *cases, int ncases, struct pollfd *pollfds);
+static int select_register(struct co_select_case *cases, int ncases, struct select_node *select_nodes);
+static void select_unregister(struct co_select_case *cases, int ncases, struct select_node *select_nodes);
+static void select_pass_wakeups(struct co_select_case *cases, int ncases, int selected);
+static inline void enqueue_coroutine(struct coroutine *coroutine);
+static inline void ready_coroutine(struct coroutine *coroutine);
+static inline void wake_coroutine(struct coroutine *coroutine);
+static struct coroutine *next_ready_coroutine();
+static int has_ready_coroutine();
+static inline int run_budget_left();
+static inline void switch_coroutine(struct coroutine *coroutine);
+static inline void switch_to_next();
+static int wait_on(struct list_head *waiters, double timeout, int interruptible);
+static void wake_waiter(struct list_head *waiters);
 static inline void signal_callback(struct event_loop *ev, int signo, void *arg);
 static inline void co_signal_callback(void *arg);
 static struct waiting_node *find_waiting_node(int64_t channel_id, int create);
@@ -82,7 +340,21 @@ static inline void enable_preempt_interrupt();
 static inline void disable_preempt_interrupt();
 
 int co_env(void (*co_start)(void *), void *arg);
-int co_make(uint32_t stack_size, void(*routine)(void *), void *arg);
+int64_t co_make(uint32_t stack_size, void(*routine)(void *), void *arg);
+int64_t co_self();
+int co_join(int64_t co_id, double timeout);
+int co_cancel(int64_t co_id);
+int co_set_priority(int64_t co_id, int priority);
+int co_get_priority(int64_t co_id);
+int co_set_dispatch(int mode, const int *weights);
+double co_time();
+int co_set_deadline(double deadline);
+double co_get_deadline();
+struct co_group *co_group_create();
+int co_group_destroy(struct co_group *group);
+int64_t co_group_make(struct co_group *group, uint32_t stack_size, void(*routine)(void *), void *arg);
+void co_group_cancel(struct co_group *group);
+int co_group_join(struct co_group *group, double timeout);
 ssize_t co_write(int sockfd, const void *buf, size_t count, double timeout);
 ssize_t co_send(int sockfd, const void *buf, size_t len, int flags, double timeout);
 ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, double timeout);
@@ -92,9 +364,17 @@ ssize_t co_recv(int sockfd, void *buf, size_t len, int flags, double timeout);
 ssize_t co_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen, double timeout);
 ssize_t co_recvmsg(int sockfd, struct msghdr *msg, int flags, double timeout);
 int co_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+int co_connect_timeout(int sockfd, const struct sockaddr *addr, socklen_t addrlen, double timeout);
+static int connect_attempt(const struct addrinfo *ai, int *sockfd);
+int co_connect_any(const struct addrinfo *res, double timeout);
+ssize_t co_connect_fastopen(int sockfd, const struct sockaddr *addr, socklen_t addrlen, const void *buf, size_t len, double timeout);
 int co_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int co_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 void co_sleep(double seconds);
+void co_yield();
+int co_switch_to(int64_t co_id);
+void co_set_run_budget(int max_resumes, double max_seconds);
+int co_set_wakeup_mode(int mode);
 void co_add_signal(int signo, void(*handler)(int signo, void *arg), void *arg);
 void co_remove_signal(int signo);
 int channel_send(int64_t channel_id, const char *msg_ptr, size_t msg_len, double timeout);
@@ -102,6 +382,74 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 void channel_unlink(char *name);
 void channel_close(int64_t channel_id);
 int64_t channel_open(char *name, int msgsize, int maxmsg);
+int64_t channel_open_flags(char *name, int msgsize, int maxmsg, int flags);
+int ring_channel_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout);
+int ring_channel_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout);
+int co_select(struct co_select_case *cases, int ncases, double timeout);
+struct co_mutex *co_mutex_create();
+int co_mutex_destroy(struct co_mutex *mutex);
+int co_mutex_lock(struct co_mutex *mutex);
+int co_mutex_trylock(struct co_mutex *mutex);
+int co_mutex_unlock(struct co_mutex *mutex);
+struct co_cond *co_cond_create();
+int co_cond_destroy(struct co_cond *cond);
+int co_cond_wait(struct co_cond *cond, struct co_mutex *mutex, double timeout);
+void co_cond_signal(struct co_cond *cond);
+void co_cond_broadcast(struct co_cond *cond);
+struct co_sem *co_sem_create(int64_t value);
+int co_sem_destroy(struct co_sem *sem);
+int co_sem_wait(struct co_sem *sem, double timeout);
+void co_sem_post(struct co_sem *sem);
+struct co_waitgroup *co_waitgroup_create();
+int co_waitgroup_destroy(struct co_waitgroup *wg);
+int co_waitgroup_add(struct co_waitgroup *wg, int64_t delta);
+void co_waitgroup_done(struct co_waitgroup *wg);
+int co_waitgroup_wait(struct co_waitgroup *wg, double timeout);
+struct co_pool *co_pool_create(int workers, uint32_t stack_size);
+int co_pool_set_max_workers(struct co_pool *pool, int max_workers);
+int co_go(struct co_pool *pool, void (*routine)(void *), void *arg);
+void co_pool_destroy(struct co_pool *pool);
+int co_set_stack_reclaim(double idle_seconds);
+int co_get_stack_stats(struct co_stack_stats *stats);
+ssize_t co_stack_high_water(int64_t co_id);
+int co_set_stack_profile(int enable);
+int co_stack_profile_dump(int fd);
+int co_set_mem_placement(int flags);
+int co_get_slab_stats(struct co_slab_stats *stats);
+static void add_slab_stats(struct co_slab_stats *stats, struct slab_cache *cache);
+void *co_arena_alloc(size_t size);
+void co_arena_reset();
+static void release_arena(struct coroutine *coroutine);
+int co_key_create(int *key, void (*destructor)(void *value));
+int co_key_delete(int key);
+void *co_getspecific(int key);
+int co_setspecific(int key, const void *value);
+int co_in_coroutine();
+void *co_run_blocking(void *(*fn)(void *arg), void *arg);
+int co_set_blocking_threads(int max_threads);
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int co_fsync(int fd);
+static void *blocking_worker(void *arg);
+static void blocking_done_callback(struct event_loop *ev, int fd, int event_type, void *arg);
+static int start_blocking_pool();
+static void stop_blocking_pool();
+static void *blocking_pread(void *arg);
+static void *blocking_pwrite(void *arg);
+static void *blocking_fsync(void *arg);
+int co_post(void (*fn)(void *arg), void *arg, int flags);
+static void run_post_task(struct event_loop *ev, void *arg);
+static void close_posts();
+struct co_connpool *co_connpool_create(int max_idle, int max_active, double idle_timeout);
+int co_connpool_get(struct co_connpool *pool, const struct sockaddr *addr, socklen_t addrlen, double timeout);
+int co_connpool_put(struct co_connpool *pool, int fd, int reusable);
+int co_connpool_destroy(struct co_connpool *pool);
+int co_connpool_get_stats(struct co_connpool *pool, struct co_connpool_stats *stats);
+static struct connpool_dest *connpool_dest(struct co_connpool *pool, const struct sockaddr *addr, socklen_t addrlen);
+static struct connpool_conn *connpool_conn(struct co_connpool *pool, int fd);
+static void connpool_close(struct connpool_conn *conn);
+static void connpool_idle_callback(struct event_loop *ev, int fd, int event_type, void *arg);
+static int connpool_sweep_callback(struct event_loop *ev, int64_t timer_id, void *arg);
 
 static inline void enable_preempt_interrupt(){
     return;
@@ -150,30 +498,64 @@ static inline void preempt_coroutine(){
 }
 
 static inline void routine_start(struct coroutine *coroutine){
-    int i;
     cur_coroutine = coroutine;
     enable_preempt_interrupt();
-    for(i = 0; i < COROUTINE_CHANNEL_HASH_SIZE; i++){
-        INIT_HLIST_HEAD(&coroutine->channels[i]);
-    }
 
     coroutine->routine(coroutine->arg);
 
+    if(coroutine->stack_profiled && coroutine->routine != pool_worker){
+        record_stack_usage(coroutine->routine, stack_usage(coroutine));
+    }
+    if(coroutine->deadline_timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, coroutine->deadline_timer_id);
+    }
+    run_key_destructors(coroutine);
+    release_arena(coroutine);
+    close_coroutine_channels(coroutine);
+    hlist_del(&(coroutine->hash_node));
+    while(!list_empty(&(coroutine->joiners))){
+        wake_waiter(&(coroutine->joiners));
+    }
+    if(coroutine->group){
+        list_del(&(coroutine->group_node));
+        while(list_empty(&(coroutine->group->children)) && !list_empty(&(coroutine->group->waiters))){
+            wake_waiter(&(coroutine->group->waiters));
+        }
+    }
+    if(!list_empty(&(coroutine->list_node))){
+        list_del(&(coroutine->list_node));
+    }
+    main_event_loop->add_defer(main_event_loop, defer_destroy_coroutine, coroutine);
+    yield_coroutine();
+}
+
+/*
+ * The channel hash is only allocated by the first channel_open() of a
+ * coroutine; until then every lookup sees the same empty bucket.
+ */
+static inline struct hlist_head *coroutine_channel_head(struct coroutine *coroutine, int64_t channel_id){
+    if(!coroutine->channels){
+        return &empty_channel_head;
+    }
+    return &(coroutine->channels[channel_id & (COROUTINE_CHANNEL_HASH_SIZE - 1)]);
+}
+
+static void close_coroutine_channels(struct coroutine *coroutine){
+    int i;
     struct hlist_head *head;
     struct hlist_node *cur, *next;
     struct channel_node *channel_node;
+    if(!coroutine->channels){
+        return;
+    }
     for(i=0; i < COROUTINE_CHANNEL_HASH_SIZE; i++){
         head = &coroutine->channels[i];
         hlist_for_each_entry_safe(channel_node, cur, next, head, node){
 	    channel_close(channel_node->channel_id);
+            hlist_del(&(channel_node->node));
             free(channel_node);
         }
     }
-    if(!list_empty(&(coroutine->list_node))){
-        list_del(&(coroutine->list_node));
-    }
-    main_event_loop->add_defer(main_event_loop, defer_destroy_coroutine, coroutine);
-    yield_coroutine();
 }
 
 static inline int defer_destroy_coroutine(struct event_loop *ev, void *coroutine){
@@ -182,6 +564,7 @@ static inline int defer_destroy_coroutine(struct event_loop *ev, void *coroutine
 }
 
 static inline void destroy_coroutine(struct coroutine* coroutine){
+    free(coroutine->channels);
     munmap(coroutine->mem_base, coroutine->mem_size);
     coroutine_count -= 1;
 }
@@ -191,12 +574,29 @@ static inline void resume_coroutine(struct coroutine *coroutine){
     if(cur_coroutine != &main_coroutine){
         disable_preempt_interrupt();
     }
-    if((cur_coroutine != &main_coroutine) && list_empty(&(cur_coroutine->list_node))){
-        list_add_before(&(cur_coroutine->list_node), &ready_co_head);
+    if(cur_coroutine != &main_coroutine){
+        enqueue_coroutine(cur_coroutine);
+    }
+    if(coroutine != &main_coroutine){
+        enqueue_coroutine(coroutine);
+    }
+    switch_coroutine(coroutine);
+}
+
+static inline void yield_coroutine(){
+    assert(cur_coroutine != &main_coroutine);
+    disable_preempt_interrupt();
+    if(!list_empty(&(cur_coroutine->list_node))){
+        list_del(&(cur_coroutine->list_node));
     }
-    if((coroutine != &main_coroutine) && list_empty(&(coroutine->list_node))){
-        list_add_before(&(coroutine->list_node), &ready_co_head);
+    if(stack_reclaim_idle > 0){
+        cur_coroutine->parked_at = co_time();
+        cur_coroutine->stack_reclaimed = 0;
     }
+    switch_to_next();
+}
+
+static inline void switch_coroutine(struct coroutine *coroutine){
     if(cur_coroutine != &main_coroutine){
         memset(&(cur_coroutine->resume_time), 0, sizeof(cur_coroutine->resume_time));
     }
@@ -210,26 +610,183 @@ static inline void resume_coroutine(struct coroutine *coroutine){
     }
 }
 
-static inline void yield_coroutine(){
-    assert(cur_coroutine != &main_coroutine);
-    disable_preempt_interrupt();
-    if(!list_empty(&(cur_coroutine->list_node))){
-        list_del(&(cur_coroutine->list_node));
+/*
+ * Jump straight to the next runnable coroutine instead of bouncing
+ * through main_coroutine, so a handoff costs one context switch. The
+ * scheduler only gets control back when nothing is runnable or the run
+ * budget is spent and the event loop is due.
+ */
+static inline void switch_to_next(){
+    struct coroutine *next;
+    if(run_budget_left() && (next = next_ready_coroutine())){
+        run_resumed += 1;
+        if(next == cur_coroutine){
+            enable_preempt_interrupt();
+            return;
+        }
+        switch_coroutine(next);
+    } else {
+        switch_coroutine(&main_coroutine);
     }
-    memset(&(cur_coroutine->resume_time), 0, sizeof(cur_coroutine->resume_time));
-    cur_coroutine = jump_fcontext(&(cur_coroutine->stack_pointer), main_coroutine.stack_pointer, &main_coroutine, 1);
-    enable_preempt_interrupt();
+}
+
+static inline void enqueue_coroutine(struct coroutine *coroutine){
+    struct list_head *pos, *head = &ready_co_heads[coroutine->priority];
+    struct coroutine *queued;
+    if(!list_empty(&(coroutine->list_node))){
+        return;
+    }
+    pos = head;
+    if(dispatch_edf && coroutine->deadline > 0){
+        /* Keep the queue sorted by deadline; no deadline sorts last. */
+        list_for_each_reverse(pos, head){
+            queued = list_entry(pos, struct coroutine, list_node);
+            if(queued->deadline > 0 && queued->deadline <= coroutine->deadline){
+                break;
+            }
+        }
+        pos = pos->next;
+    }
+    list_add_before(&(coroutine->list_node), pos);
+}
+
+/*
+ * A coroutine made runnable from an event loop callback must not wait
+ * behind a blocking epoll_wait. From inside a coroutine the scheduler
+ * picks it up before the loop is polled again.
+ */
+static inline void ready_coroutine(struct coroutine *coroutine){
+    enqueue_coroutine(coroutine);
+    if(main_event_loop && cur_coroutine == &main_coroutine){
+        main_event_loop->wakeup(main_event_loop);
+    }
+}
+
+/*
+ * Strict dispatch always serves the most urgent non-empty class. Weighted
+ * dispatch lets each class run up to its weight of coroutines per round,
+ * so bulk classes still progress while latency-critical ones are busy.
+ */
+static struct coroutine *next_ready_coroutine(){
+    int i, refilled = 0;
+    if(dispatch_mode == CO_DISPATCH_WEIGHTED){
+        while(1){
+            for(i = 0; i < CO_PRIORITY_LEVELS; i++){
+                if(!list_empty(&ready_co_heads[i]) && dispatch_credits[i] > 0){
+                    dispatch_credits[i] -= 1;
+                    return list_entry(ready_co_heads[i].next, struct coroutine, list_node);
+                }
+            }
+            if(refilled){
+                break;
+            }
+            memcpy(dispatch_credits, dispatch_weights, sizeof(dispatch_credits));
+            refilled = 1;
+        }
+    }
+    for(i = 0; i < CO_PRIORITY_LEVELS; i++){
+        if(!list_empty(&ready_co_heads[i])){
+            return list_entry(ready_co_heads[i].next, struct coroutine, list_node);
+        }
+    }
+    return NULL;
+}
+
+static inline int run_budget_left(){
+    if(run_budget > 0 && run_resumed >= run_budget){
+        return 0;
+    }
+    if(run_budget_time > 0 && co_time() - run_started >= run_budget_time){
+        return 0;
+    }
+    return 1;
+}
+
+static int has_ready_coroutine(){
+    int i;
+    for(i = 0; i < CO_PRIORITY_LEVELS; i++){
+        if(!list_empty(&ready_co_heads[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Called from event loop callbacks. In queued mode the coroutine only
+ * becomes runnable, and runs once the whole batch of events has been
+ * dispatched and the loop has returned to co_env.
+ */
+static inline void wake_coroutine(struct coroutine *coroutine){
+    if(wakeup_mode == CO_WAKEUP_QUEUED){
+        ready_coroutine(coroutine);
+    } else {
+        resume_coroutine(coroutine);
+        /* It has already run; only work it left runnable, say with the run budget spent, needs the loop to hurry. */
+        if(cur_coroutine == &main_coroutine && has_ready_coroutine()){
+            main_event_loop->wakeup(main_event_loop);
+        }
+    }
+}
+
+static inline int coroutine_interrupted(){
+    if(cur_coroutine->interrupted){
+        errno = cur_coroutine->interrupted;
+        return 1;
+    }
+    return 0;
+}
+
+static int deadline_callback(struct event_loop *ev, int64_t timer_id, void *arg){
+    struct coroutine *coroutine = arg;
+    coroutine->deadline_timer_id = 0;
+    if(!coroutine->interrupted){
+        coroutine->interrupted = ETIMEDOUT;
+    }
+    if(list_empty(&(coroutine->list_node))){
+        wake_coroutine(coroutine);
+    }
+    return 0;
+}
+
+/*
+ * With a deadline armed, a wait only needs its own timer when that timer
+ * would fire first; otherwise the deadline timer interrupts the wait.
+ */
+static inline double call_timeout(double timeout){
+    if(timeout != 0 && cur_coroutine->deadline_timer_id > 0 && (timeout < 0 || cur_coroutine->deadline - co_time() <= timeout)){
+        return -1;
+    }
+    return timeout;
 }
 
 static inline void reader_writer_callback(struct event_loop *ev, int fd, int event_type, void *coroutine){
-    resume_coroutine(coroutine);
+    wake_coroutine(coroutine);
 }
 
 static inline int sleep_callback(struct event_loop *ev, int64_t timer_id, void *coroutine){
-    resume_coroutine(coroutine);
+    wake_coroutine(coroutine);
+    return 0;
+}
+
+static inline int timeout_callback(struct event_loop *ev, int64_t timer_id, void *arg){
+    struct timeout_node *timeout_node = arg;
+    timeout_node->fired = 1;
+    wake_coroutine(timeout_node->coroutine);
     return 0;
 }
 
+static inline int64_t add_timeout(struct timeout_node *timeout_node, double timeout){
+    int integer_seconds = (int)(timeout);
+    long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
+    struct timespec ts;
+    ts.tv_sec = integer_seconds;
+    ts.tv_nsec = nano_seconds;
+    timeout_node->coroutine = cur_coroutine;
+    timeout_node->fired = 0;
+    return main_event_loop->add_timer(main_event_loop, &ts, timeout_callback, timeout_node);
+}
+
 static inline void co_signal_callback(void *arg) {
     struct co_signal_arg *co_signal_arg = arg;
     co_signal_arg->handler(co_signal_arg->signo, co_signal_arg->arg);
@@ -274,14 +831,22 @@ static struct waiting_node *find_waiting_node(int64_t channel_id, int create){
 int co_env(void (*co_start)(void *), void *arg){
     assert(!main_event_loop);
     int ret = 0;
-    struct coroutine *cur, *next;
-    main_event_loop = alloc_event_loop();
+    struct coroutine *cur;
+    __atomic_store_n(&post_closing, 0, __ATOMIC_SEQ_CST);
+    main_event_loop = alloc_event_loop_placed(mem_placement_flags);
     main_channel_pool = alloc_channel_pool();
+    loop_thread = pthread_self();
     sigemptyset(&signal_set);
     int i;
     for(i = 0; i < WAITING_COROUTINE_HASH_SIZE; i++){
         INIT_HLIST_HEAD(&waiting_coroutine_hash[i]);
     }
+    for(i = 0; i < COROUTINE_HASH_SIZE; i++){
+        INIT_HLIST_HEAD(&coroutine_hash[i]);
+    }
+    for(i = 0; i < CO_PRIORITY_LEVELS; i++){
+        INIT_LIST_HEAD(&ready_co_heads[i]);
+    }
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(struct sigaction));
@@ -298,19 +863,44 @@ int co_env(void (*co_start)(void *), void *arg){
     itimerval.it_value.tv_usec = 10000;
     setitimer(ITIMER_PROF, &itimerval, NULL);
 
+    if(stack_reclaim_idle > 0){
+        arm_stack_reclaim();
+    }
     co_make(0, co_start, arg);
-    while((!sigisemptyset(&signal_set) || coroutine_count) && ret >= 0){
-        while(!list_empty(&ready_co_head)){
-           list_for_each_entry_safe(cur, next, &ready_co_head, list_node) {
-	       resume_coroutine(cur);
-           }
-	}
-        ret = main_event_loop->poll(main_event_loop, -1);
+    while(1){
+        while((!sigisemptyset(&signal_set) || coroutine_count) && ret >= 0){
+            run_resumed = 0;
+            if(run_budget_time > 0){
+                run_started = co_time();
+            }
+            while(run_budget_left() && (cur = next_ready_coroutine())){
+                run_resumed += 1;
+	        resume_coroutine(cur);
+	    }
+            ret = main_event_loop->poll(main_event_loop, has_ready_coroutine() ? 0 : -1);
+        }
+        if(ret < 0){
+            break;
+        }
+        /*
+         * Every post co_post() accepted runs, even one which raced with the
+         * last coroutine exiting. If such a post brings coroutines back the
+         * loop is not returning after all, so posting is reopened.
+         */
+        close_posts();
+        if(!__atomic_load_n(&(main_event_loop->post_head), __ATOMIC_ACQUIRE)){
+            break;
+        }
+        ret = main_event_loop->poll(main_event_loop, 0);
+        if(coroutine_count || !sigisemptyset(&signal_set)){
+            __atomic_store_n(&post_closing, 0, __ATOMIC_SEQ_CST);
+        }
     }
 
     struct hlist_node *cur_waiting, *next_waiting;
     struct hlist_head *waiting_head;
     struct waiting_node *waiting_node;
+    struct ring_channel *cur_ring, *next_ring;
 
     for(i = 0; i < WAITING_COROUTINE_HASH_SIZE; i++){
         waiting_head = &waiting_coroutine_hash[i];
@@ -318,14 +908,35 @@ int co_env(void (*co_start)(void *), void *arg){
 	   free(waiting_node);
         }
     }
+    list_for_each_entry_safe(cur_ring, next_ring, &ring_channel_head, ev_node){
+        list_del(&(cur_ring->ev_node));
+        cur_ring->ev = NULL;
+    }
+    stop_blocking_pool();
+    run_key_destructors(&main_coroutine);
+    release_arena(&main_coroutine);
+    close_coroutine_channels(&main_coroutine);
+    free(main_coroutine.channels);
+    main_coroutine.channels = NULL;
+    while(arena_free_chunks){
+        struct arena_chunk *chunk = arena_free_chunks;
+        arena_free_chunks = chunk->next;
+        free(chunk);
+    }
+    arena_free_chunk_count = 0;
     free_event_loop(main_event_loop);
     free_channel_pool(main_channel_pool);
+    stack_reclaim_timer_id = 0;
     main_event_loop = NULL;
     main_channel_pool = NULL;
     return ret;
 }
 
-int co_make(uint32_t stack_size, void(*routine)(void *), void *arg){
+int64_t co_make(uint32_t stack_size, void(*routine)(void *), void *arg){
+    return make_coroutine(stack_size, routine, arg, NULL);
+}
+
+static int64_t make_coroutine(uint32_t stack_size, void(*routine)(void *), void *arg, struct co_group *group){
     int page_size = sysconf(_SC_PAGE_SIZE);
     if(!stack_size){
         stack_size = DEFAULT_COROUTINE_STACK_SIZE;
@@ -337,104 +948,338 @@ int co_make(uint32_t stack_size, void(*routine)(void *), void *arg){
         map_size += page_size;
 	map_size -= (map_size & (page_size - 1));
     }
-    void *mem_base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1 ,0);
-    if(!mem_base){
-        return -1;
+    void *mem_base;
+    if(mem_placement_flags){
+        size_t placed_size = map_size;
+        mem_base = mem_placement_map(&placed_size, page_size, mem_placement_flags);
+        if(!mem_base){
+            return -1;
+        }
+        map_size = placed_size;
+        stack_size = map_size - page_size - sizeof(struct coroutine);
+    } else {
+        mem_base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1 ,0);
+        if(mem_base == MAP_FAILED){
+            return -1;
+        }
+        mprotect(mem_base, page_size, PROT_NONE);
     }
-    mprotect(mem_base, page_size, PROT_NONE);
     struct coroutine *coroutine = (struct coroutine *)((char *)mem_base + map_size - sizeof(struct coroutine));
     memset(coroutine, 0, sizeof(struct coroutine));
     INIT_LIST_HEAD(&(coroutine->list_node));
     coroutine->mem_base = mem_base;
     coroutine->mem_size = map_size;
     coroutine->stack_size = stack_size;
+    if(stack_profile_enabled){
+        memset((char *)mem_base + page_size, STACK_CANARY, (char *)coroutine - (char *)mem_base - page_size);
+        coroutine->stack_profiled = 1;
+    }
     coroutine->routine = routine;
     coroutine->arg = arg;
     coroutine->stack_pointer = make_fcontext((char *)coroutine - 1, stack_size, routine_start);
+    coroutine->id = next_coroutine_id++;
+    INIT_LIST_HEAD(&(coroutine->joiners));
+    hlist_add_head(&(coroutine->hash_node), &coroutine_hash[coroutine->id & (COROUTINE_HASH_SIZE - 1)]);
+    coroutine->group = group;
+    coroutine->priority = cur_coroutine == &main_coroutine ? CO_PRIORITY_NORMAL : cur_coroutine->priority;
+    if(group){
+        list_add_before(&(coroutine->group_node), &(group->children));
+    }
     coroutine_count += 1;
+    int64_t co_id = coroutine->id;
     resume_coroutine(coroutine);
-    return 0;
+    return co_id;
 }
 
-ssize_t co_write(int sockfd, const void *buf, size_t count, double timeout){
-    assert(main_event_loop);
-    int ret, timeout_ret = 0;
-    loop:
-    while((ret = main_event_loop->write(main_event_loop, sockfd, buf, count)) < 0 && errno == EINTR){
+static struct coroutine *find_coroutine(int64_t co_id){
+    struct hlist_node *cur;
+    struct coroutine *coroutine;
+    hlist_for_each_entry(coroutine, cur, &coroutine_hash[co_id & (COROUTINE_HASH_SIZE - 1)], hash_node){
+        if(coroutine->id == co_id){
+            return coroutine;
+        }
     }
-    if(ret >= 0 || timeout == 0){
-        return ret;
+    return NULL;
+}
+
+/*
+ * A cancelled coroutine is queued to run; whatever co_* call it is parked
+ * in finds the flag when it wakes, drops its timer and fd registration
+ * and fails with ECANCELED. Every later wait fails the same way.
+ */
+static void cancel_coroutine(struct coroutine *coroutine){
+    coroutine->interrupted = ECANCELED;
+    if(coroutine != cur_coroutine){
+        ready_coroutine(coroutine);
     }
-    if(timeout_ret == 1){
-        errno = 0;
-        return 0;
+}
+
+int64_t co_self(){
+    return cur_coroutine->id;
+}
+
+/*
+ * cur_coroutine is shared by all threads, so a thread other than the one
+ * running co_env() must not mistake the loop's coroutine for its own.
+ */
+int co_in_coroutine(){
+    return main_event_loop && cur_coroutine != &main_coroutine && pthread_equal(pthread_self(), loop_thread);
+}
+
+int co_join(int64_t co_id, double timeout){
+    assert(main_event_loop);
+    struct coroutine *coroutine = find_coroutine(co_id);
+    if(!coroutine){
+        if(co_id > 0 && co_id < next_coroutine_id){
+            return 0;
+        }
+        errno = ESRCH;
+        return -1;
     }
-    if(ret == -1 && errno == EAGAIN){
-	main_event_loop->add_writer(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
-        int64_t timer_id = 0;
-	if(timeout > 0) {
-            int integer_seconds = (int)(timeout);
-            long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
-            struct timespec ts;
-            ts.tv_sec = integer_seconds;
-            ts.tv_nsec = nano_seconds;
-            timer_id = main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
-	}
-        yield_coroutine();
-	if(timer_id > 0){
-            main_event_loop->remove_timer(main_event_loop, timer_id);
-	    timeout_ret = 1;
-	}
-	main_event_loop->remove_writer(main_event_loop, sockfd);
-	goto loop;
+    if(coroutine == cur_coroutine){
+        errno = EDEADLK;
+        return -1;
     }
-    return ret;
+    return wait_on(&(coroutine->joiners), timeout, 1);
 }
 
-ssize_t co_send(int sockfd, const void *buf, size_t len, int flags, double timeout) {
+int co_cancel(int64_t co_id){
     assert(main_event_loop);
-    int ret, timeout_ret = 0;
-    loop:
-    while((ret = main_event_loop->send(main_event_loop, sockfd, buf, len, flags)) < 0 && errno == EINTR){
+    struct coroutine *coroutine = find_coroutine(co_id);
+    if(!coroutine){
+        if(co_id > 0 && co_id < next_coroutine_id){
+            return 0;
+        }
+        errno = ESRCH;
+        return -1;
     }
-    if(ret >= 0 || timeout == 0){
-        return ret;
+    cancel_coroutine(coroutine);
+    return 0;
+}
+
+int co_set_priority(int64_t co_id, int priority){
+    assert(main_event_loop);
+    struct coroutine *coroutine = find_coroutine(co_id);
+    if(priority < 0 || priority >= CO_PRIORITY_LEVELS){
+        errno = EINVAL;
+        return -1;
     }
-    if(timeout_ret == 1){
-        errno = 0;
-        return 0;
+    if(!coroutine){
+        errno = ESRCH;
+        return -1;
     }
-    if(ret == -1 && errno == EAGAIN){
-	main_event_loop->add_writer(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
-        int64_t timer_id = 0;
-	if(timeout > 0) {
-            int integer_seconds = (int)(timeout);
-            long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
-            struct timespec ts;
-            ts.tv_sec = integer_seconds;
-            ts.tv_nsec = nano_seconds;
-            timer_id = main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
-	}
-        yield_coroutine();
-	if(timer_id > 0){
-            main_event_loop->remove_timer(main_event_loop, timer_id);
-	    timeout_ret = 1;
-	}
-	main_event_loop->remove_writer(main_event_loop, sockfd);
-	goto loop;
+    if(coroutine->priority != priority && !list_empty(&(coroutine->list_node))){
+        list_del(&(coroutine->list_node));
+        coroutine->priority = priority;
+        ready_coroutine(coroutine);
     }
-    return ret;
+    coroutine->priority = priority;
+    return 0;
 }
 
-ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, double timeout){
+int co_get_priority(int64_t co_id){
     assert(main_event_loop);
-    int ret, timeout_ret = 0;
+    struct coroutine *coroutine = find_coroutine(co_id);
+    if(!coroutine){
+        errno = ESRCH;
+        return -1;
+    }
+    return coroutine->priority;
+}
+
+int co_set_dispatch(int mode, const int *weights){
+    int i, edf = mode & CO_DISPATCH_EDF;
+    mode &= ~CO_DISPATCH_EDF;
+    if(mode == CO_DISPATCH_WEIGHTED){
+        for(i = 0; i < CO_PRIORITY_LEVELS; i++){
+            if(weights[i] <= 0){
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        memcpy(dispatch_weights, weights, sizeof(dispatch_weights));
+        memcpy(dispatch_credits, weights, sizeof(dispatch_credits));
+    } else if(mode != CO_DISPATCH_STRICT){
+        errno = EINVAL;
+        return -1;
+    }
+    dispatch_mode = mode;
+    dispatch_edf = edf;
+    return 0;
+}
+
+double co_time(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int co_set_deadline(double deadline){
+    assert(main_event_loop && cur_coroutine != &main_coroutine);
+    double remaining;
+    struct timespec ts;
+    if(cur_coroutine->deadline_timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, cur_coroutine->deadline_timer_id);
+        cur_coroutine->deadline_timer_id = 0;
+    }
+    if(cur_coroutine->interrupted == ETIMEDOUT){
+        cur_coroutine->interrupted = 0;
+    }
+    cur_coroutine->deadline = deadline > 0 ? deadline : 0;
+    if(!cur_coroutine->deadline){
+        return 0;
+    }
+    remaining = deadline - co_time();
+    if(remaining <= 0){
+        if(!cur_coroutine->interrupted){
+            cur_coroutine->interrupted = ETIMEDOUT;
+        }
+        return 0;
+    }
+    ts.tv_sec = (time_t)remaining;
+    ts.tv_nsec = (long)((remaining - ts.tv_sec) * 1000000000);
+    cur_coroutine->deadline_timer_id = main_event_loop->add_timer(main_event_loop, &ts, deadline_callback, cur_coroutine);
+    if(cur_coroutine->deadline_timer_id < 0){
+        cur_coroutine->deadline_timer_id = 0;
+        cur_coroutine->deadline = 0;
+        return -1;
+    }
+    return 0;
+}
+
+double co_get_deadline(){
+    return cur_coroutine->deadline;
+}
+
+struct co_group *co_group_create(){
+    struct co_group *group = calloc(1, sizeof(struct co_group));
+    if(!group){
+        return NULL;
+    }
+    INIT_LIST_HEAD(&(group->children));
+    INIT_LIST_HEAD(&(group->waiters));
+    return group;
+}
+
+int co_group_destroy(struct co_group *group){
+    if(!list_empty(&(group->children)) || !list_empty(&(group->waiters))){
+        errno = EBUSY;
+        return -1;
+    }
+    free(group);
+    return 0;
+}
+
+int64_t co_group_make(struct co_group *group, uint32_t stack_size, void(*routine)(void *), void *arg){
+    return make_coroutine(stack_size, routine, arg, group);
+}
+
+void co_group_cancel(struct co_group *group){
+    struct coroutine *coroutine;
+    list_for_each_entry(coroutine, &(group->children), group_node){
+        cancel_coroutine(coroutine);
+    }
+}
+
+int co_group_join(struct co_group *group, double timeout){
+    assert(main_event_loop);
+    if(list_empty(&(group->children))){
+        return 0;
+    }
+    return wait_on(&(group->waiters), timeout, 1);
+}
+
+ssize_t co_write(int sockfd, const void *buf, size_t count, double timeout){
+    assert(main_event_loop);
+    int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
+    loop:
+    while((ret = main_event_loop->write(main_event_loop, sockfd, buf, count)) < 0 && errno == EINTR){
+    }
+    if(ret >= 0 || timeout == 0){
+        return ret;
+    }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
+    if(timeout_ret == 1){
+        errno = 0;
+        return 0;
+    }
+    if(ret == -1 && errno == EAGAIN){
+	main_event_loop->add_writer(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
+        int64_t timer_id = 0;
+	if(timeout > 0) {
+            int integer_seconds = (int)(timeout);
+            long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
+            struct timespec ts;
+            ts.tv_sec = integer_seconds;
+            ts.tv_nsec = nano_seconds;
+            timer_id = main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
+	}
+        yield_coroutine();
+	if(timer_id > 0){
+            main_event_loop->remove_timer(main_event_loop, timer_id);
+	    timeout_ret = 1;
+	}
+	main_event_loop->remove_writer(main_event_loop, sockfd, cur_coroutine);
+	goto loop;
+    }
+    return ret;
+}
+
+ssize_t co_send(int sockfd, const void *buf, size_t len, int flags, double timeout) {
+    assert(main_event_loop);
+    int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
+    loop:
+    while((ret = main_event_loop->send(main_event_loop, sockfd, buf, len, flags)) < 0 && errno == EINTR){
+    }
+    if(ret >= 0 || timeout == 0){
+        return ret;
+    }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
+    if(timeout_ret == 1){
+        errno = 0;
+        return 0;
+    }
+    if(ret == -1 && errno == EAGAIN){
+	main_event_loop->add_writer(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
+        int64_t timer_id = 0;
+	if(timeout > 0) {
+            int integer_seconds = (int)(timeout);
+            long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
+            struct timespec ts;
+            ts.tv_sec = integer_seconds;
+            ts.tv_nsec = nano_seconds;
+            timer_id = main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
+	}
+        yield_coroutine();
+	if(timer_id > 0){
+            main_event_loop->remove_timer(main_event_loop, timer_id);
+	    timeout_ret = 1;
+	}
+	main_event_loop->remove_writer(main_event_loop, sockfd, cur_coroutine);
+	goto loop;
+    }
+    return ret;
+}
+
+ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen, double timeout){
+    assert(main_event_loop);
+    int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->sendto(main_event_loop, sockfd, buf, len, flags, dest_addr, addrlen)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -455,7 +1300,7 @@ ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const stru
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_writer(main_event_loop, sockfd);
+	main_event_loop->remove_writer(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -464,12 +1309,16 @@ ssize_t co_sendto(int sockfd, const void *buf, size_t len, int flags, const stru
 ssize_t co_sendmsg(int sockfd, const struct msghdr *msg, int flags, double timeout){
     assert(main_event_loop);
     int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->sendmsg(main_event_loop, sockfd, msg, flags)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -490,7 +1339,7 @@ ssize_t co_sendmsg(int sockfd, const struct msghdr *msg, int flags, double timeo
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_writer(main_event_loop, sockfd);
+	main_event_loop->remove_writer(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -499,12 +1348,16 @@ ssize_t co_sendmsg(int sockfd, const struct msghdr *msg, int flags, double timeo
 ssize_t co_read(int sockfd, void *buf, size_t count, double timeout){
     assert(main_event_loop);
     int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->read(main_event_loop, sockfd, buf, count)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -525,7 +1378,7 @@ ssize_t co_read(int sockfd, void *buf, size_t count, double timeout){
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -534,12 +1387,16 @@ ssize_t co_read(int sockfd, void *buf, size_t count, double timeout){
 ssize_t co_recv(int sockfd, void *buf, size_t len, int flags, double timeout){
     assert(main_event_loop);
     int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->recv(main_event_loop, sockfd, buf, len, flags)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -560,7 +1417,7 @@ ssize_t co_recv(int sockfd, void *buf, size_t len, int flags, double timeout){
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -569,12 +1426,16 @@ ssize_t co_recv(int sockfd, void *buf, size_t len, int flags, double timeout){
 ssize_t co_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen, double timeout){
     assert(main_event_loop);
     int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->recvfrom(main_event_loop, sockfd, buf, len, flags, src_addr, addrlen)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -595,7 +1456,7 @@ ssize_t co_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockadd
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -604,12 +1465,16 @@ ssize_t co_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockadd
 ssize_t co_recvmsg(int sockfd, struct msghdr *msg, int flags, double timeout){
     assert(main_event_loop);
     int ret, timeout_ret = 0;
+    timeout = call_timeout(timeout);
     loop:
     while((ret = main_event_loop->recvmsg(main_event_loop, sockfd, msg, flags)) < 0 && errno == EINTR){
     }
     if(ret >= 0 || timeout == 0){
         return ret;
     }
+    if(ret == -1 && errno == EAGAIN && coroutine_interrupted()){
+        return -1;
+    }
     if(timeout_ret == 1){
         errno = 0;
         return 0;
@@ -630,22 +1495,46 @@ ssize_t co_recvmsg(int sockfd, struct msghdr *msg, int flags, double timeout){
             main_event_loop->remove_timer(main_event_loop, timer_id);
 	    timeout_ret = 1;
 	}
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
 }
 
 int co_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
+    return co_connect_timeout(sockfd, addr, addrlen, -1);
+}
+
+int co_connect_timeout(int sockfd, const struct sockaddr *addr, socklen_t addrlen, double timeout){
     assert(main_event_loop);
+    struct timeout_node timeout_node;
+    int64_t timer_id = 0;
     int ret, optval;
     socklen_t optlen = sizeof(optval);
+    timeout = call_timeout(timeout);
     while((ret = connect(sockfd, addr, addrlen)) < 0 && errno == EINTR){
     }
-    if(ret == -1 && (errno == EAGAIN || errno == EINPROGRESS)){
+    if(ret == -1 && (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY)){
+        if(timeout == 0 || coroutine_interrupted()){
+            return -1;
+        }
+        timeout_node.fired = 0;
+        if(timeout > 0){
+            timer_id = add_timeout(&timeout_node, timeout);
+        }
 	main_event_loop->add_writer(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
 	yield_coroutine();
-	main_event_loop->remove_writer(main_event_loop, sockfd);
+	main_event_loop->remove_writer(main_event_loop, sockfd, cur_coroutine);
+        if(timer_id > 0 && !timeout_node.fired){
+            main_event_loop->remove_timer(main_event_loop, timer_id);
+        }
+        if(coroutine_interrupted()){
+            return -1;
+        }
+        if(timeout_node.fired){
+            errno = ETIMEDOUT;
+            return -1;
+        }
 	optval = 0;
 	getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
 	if(optval != 0){
@@ -658,6 +1547,173 @@ int co_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
     return ret;
 }
 
+/*
+ * Start connecting to ai. Returns 0 when connected at once, 1 while the
+ * handshake is in progress, -1 with the socket closed on failure.
+ */
+static int connect_attempt(const struct addrinfo *ai, int *sockfd){
+    int ret;
+    *sockfd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if(*sockfd < 0){
+        return -1;
+    }
+    while((ret = connect(*sockfd, ai->ai_addr, ai->ai_addrlen)) < 0 && errno == EINTR){
+    }
+    if(ret == 0){
+        return 0;
+    }
+    if(errno == EINPROGRESS){
+        return 1;
+    }
+    ret = errno;
+    close(*sockfd);
+    errno = ret;
+    return -1;
+}
+
+/*
+ * Happy Eyeballs (RFC 8305). The addresses are tried alternating between
+ * the families, starting with IPv6 when there is any, as co_getaddrinfo()
+ * lists IPv4 first. Within a family the order of res is kept. A new attempt
+ * starts every CONNECT_ATTEMPT_DELAY seconds, or as soon as all running
+ * attempts failed, without stopping the earlier ones. The first socket
+ * to connect wins and the others are closed.
+ */
+int co_connect_any(const struct addrinfo *res, double timeout){
+    assert(main_event_loop);
+    const struct addrinfo *ai;
+    int i, n = 0, na = 0, nb = 0, next = 0, inflight = 0, first_family = AF_UNSPEC, sockfd = -1, winner = -1, ret, selected, optval, saved_errno = ECONNREFUSED;
+    double deadline, next_start = 0, wait, remaining;
+    socklen_t optlen;
+    for(ai = res; ai; ai = ai->ai_next){
+        if(ai->ai_socktype != SOCK_STREAM){
+            continue;
+        }
+        if(first_family == AF_UNSPEC || ai->ai_family == AF_INET6){
+            first_family = ai->ai_family;
+        }
+        n++;
+    }
+    if(!n){
+        errno = EINVAL;
+        return -1;
+    }
+    const struct addrinfo *first[n], *second[n], *order[n];
+    struct co_select_case cases[n];
+    for(ai = res; ai; ai = ai->ai_next){
+        if(ai->ai_socktype != SOCK_STREAM){
+            continue;
+        }
+        if(ai->ai_family == first_family){
+            first[na++] = ai;
+        } else {
+            second[nb++] = ai;
+        }
+    }
+    for(i = 0; i < na || i < nb; i++){
+        if(i < na){
+            order[next++] = first[i];
+        }
+        if(i < nb){
+            order[next++] = second[i];
+        }
+    }
+    next = 0;
+    deadline = timeout > 0 ? co_time() + timeout : 0;
+    while(winner < 0){
+        if(next < n && (!inflight || co_time() >= next_start)){
+            ret = connect_attempt(order[next++], &sockfd);
+            if(ret == 0){
+                winner = sockfd;
+                break;
+            }
+            if(ret < 0){
+                saved_errno = errno;
+                continue;
+            }
+            memset(&cases[inflight], 0, sizeof(struct co_select_case));
+            cases[inflight].type = CO_SELECT_WRITE;
+            cases[inflight++].fd = sockfd;
+            next_start = co_time() + CONNECT_ATTEMPT_DELAY;
+        }
+        if(!inflight){
+            break;
+        }
+        wait = next < n ? next_start - co_time() : -1;
+        if(deadline > 0){
+            remaining = deadline - co_time();
+            if(remaining <= 0){
+                saved_errno = ETIMEDOUT;
+                break;
+            }
+            wait = wait < 0 || remaining < wait ? remaining : wait;
+        }
+        if(next < n && wait <= 0){
+            continue;
+        }
+        selected = co_select(cases, inflight, wait);
+        if(selected < 0){
+            /* Only the timer of this call may end the wait; anything else is a cancel or the deadline. */
+            if(errno != ETIMEDOUT || wait < 0 || (co_get_deadline() > 0 && co_time() >= co_get_deadline())){
+                saved_errno = errno;
+                break;
+            }
+            continue;
+        }
+        sockfd = cases[selected].fd;
+        cases[selected] = cases[--inflight];
+        optval = 0;
+        optlen = sizeof(optval);
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+        if(!optval){
+            winner = sockfd;
+            break;
+        }
+        saved_errno = optval;
+        close(sockfd);
+        next_start = 0;
+    }
+    for(i = 0; i < inflight; i++){
+        close(cases[i].fd);
+    }
+    if(winner < 0){
+        errno = saved_errno;
+    }
+    return winner;
+}
+
+/*
+ * The data rides on the SYN when the kernel holds a TCP Fast Open cookie
+ * for the server. Without one, or with Fast Open disabled, the handshake
+ * completes first and the data follows it.
+ */
+ssize_t co_connect_fastopen(int sockfd, const struct sockaddr *addr, socklen_t addrlen, const void *buf, size_t len, double timeout){
+    assert(main_event_loop);
+    double start = co_time();
+    ssize_t ret;
+    while((ret = sendto(sockfd, buf, len, MSG_FASTOPEN, addr, addrlen)) < 0 && errno == EINTR){
+    }
+    if(ret >= 0){
+        return ret;
+    }
+    if(errno != EINPROGRESS && errno != EAGAIN && errno != EOPNOTSUPP){
+        return -1;
+    }
+    if(co_connect_timeout(sockfd, addr, addrlen, timeout) < 0 && errno != EISCONN){
+        return -1;
+    }
+    if(timeout > 0 && (timeout -= co_time() - start) <= 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    /* Like the connect, a send which times out fails rather than returning 0. */
+    if((ret = co_send(sockfd, buf, len, 0, timeout)) == 0 && len > 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ret;
+}
+
 int co_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen){
     assert(main_event_loop);
     int ret;
@@ -665,9 +1721,12 @@ int co_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen){
     while((ret = main_event_loop->accept(main_event_loop, sockfd, addr, addrlen)) < 0 && errno == EINTR){
     }
     if(ret == -1 && errno == EAGAIN){
+        if(coroutine_interrupted()){
+            return -1;
+        }
 	main_event_loop->add_reader(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
 	yield_coroutine();
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -680,9 +1739,12 @@ int co_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
     while((ret = main_event_loop->accept4(main_event_loop, sockfd, addr, addrlen, flags)) < 0 && errno == EINTR){
     }
     if(ret == -1 && errno == EAGAIN){
+        if(coroutine_interrupted()){
+            return -1;
+        }
 	main_event_loop->add_reader(main_event_loop, sockfd, reader_writer_callback, cur_coroutine);
 	yield_coroutine();
-	main_event_loop->remove_reader(main_event_loop, sockfd);
+	main_event_loop->remove_reader(main_event_loop, sockfd, cur_coroutine);
 	goto loop;
     }
     return ret;
@@ -695,8 +1757,63 @@ void co_sleep(double seconds){
     struct timespec ts;
     ts.tv_sec = integer_seconds;
     ts.tv_nsec = nano_seconds;
-    main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
+    if(coroutine_interrupted()){
+        return;
+    }
+    int64_t timer_id = main_event_loop->add_timer(main_event_loop, &ts, sleep_callback, cur_coroutine);
     yield_coroutine();
+    if(cur_coroutine->interrupted){
+        main_event_loop->remove_timer(main_event_loop, timer_id);
+    }
+}
+
+/*
+ * Go to the back of the run queue without touching the event loop; the
+ * coroutine runs again after the others that are already runnable.
+ */
+void co_yield(){
+    assert(main_event_loop && cur_coroutine != &main_coroutine);
+    disable_preempt_interrupt();
+    list_del(&(cur_coroutine->list_node));
+    ready_coroutine(cur_coroutine);
+    switch_to_next();
+}
+
+/*
+ * Run the runnable coroutine co_id right now. The caller stays runnable
+ * and continues when the scheduler picks it again.
+ */
+int co_switch_to(int64_t co_id){
+    assert(main_event_loop);
+    struct coroutine *coroutine = find_coroutine(co_id);
+    if(!coroutine){
+        errno = ESRCH;
+        return -1;
+    }
+    if(coroutine == cur_coroutine){
+        errno = EINVAL;
+        return -1;
+    }
+    if(list_empty(&(coroutine->list_node))){
+        errno = EAGAIN;
+        return -1;
+    }
+    resume_coroutine(coroutine);
+    return 0;
+}
+
+void co_set_run_budget(int max_resumes, double max_seconds){
+    run_budget = max_resumes > 0 ? max_resumes : 0;
+    run_budget_time = max_seconds > 0 ? max_seconds : 0;
+}
+
+int co_set_wakeup_mode(int mode){
+    if(mode != CO_WAKEUP_DIRECT && mode != CO_WAKEUP_QUEUED){
+        errno = EINVAL;
+        return -1;
+    }
+    wakeup_mode = mode;
+    return 0;
 }
 
 void co_add_signal(int signo, void(*handler)(int signo, void *arg), void *arg){
@@ -716,14 +1833,45 @@ void co_remove_signal(int signo){
 }
 
 int64_t channel_open(char *name, int msgsize, int maxmsg){
+    return channel_open_flags(name, msgsize, maxmsg, 0);
+}
+
+int64_t channel_open_flags(char *name, int msgsize, int maxmsg, int flags){
     assert(main_channel_pool);
-    int64_t channel_id = main_channel_pool->open(main_channel_pool, name, msgsize, maxmsg);
+    int pool_flags = 0;
+    if(flags & CHANNEL_SHARED){
+        pool_flags |= CHANNEL_POOL_SHARED;
+    }
+    if(flags & CHANNEL_BROADCAST){
+        pool_flags |= CHANNEL_POOL_BROADCAST;
+    }
+    if(flags & CHANNEL_SUBSCRIBE){
+        pool_flags |= CHANNEL_POOL_BROADCAST | CHANNEL_POOL_SUBSCRIBE;
+    }
+    if(flags & CHANNEL_BROADCAST_BLOCK){
+        pool_flags |= CHANNEL_POOL_BROADCAST_BLOCK;
+    }
+    if(flags & CHANNEL_BROADCAST_DISCONNECT){
+        pool_flags |= CHANNEL_POOL_BROADCAST_DISCONNECT;
+    }
+    int64_t channel_id = main_channel_pool->open(main_channel_pool, name, msgsize, maxmsg, pool_flags);
     if(channel_id < 0){
         return -1;
     }
-    struct channel_node *channel_node = calloc(1, sizeof(channel_node));       
+    if(!cur_coroutine->channels){
+        cur_coroutine->channels = calloc(COROUTINE_CHANNEL_HASH_SIZE, sizeof(struct hlist_head));
+        if(!cur_coroutine->channels){
+            main_channel_pool->close(main_channel_pool, channel_id);
+            return -1;
+        }
+    }
+    struct channel_node *channel_node = calloc(1, sizeof(struct channel_node));
+    if(!channel_node){
+        main_channel_pool->close(main_channel_pool, channel_id);
+        return -1;
+    }
     channel_node->channel_id = channel_id;
-    struct hlist_head *head = &(cur_coroutine->channels[channel_id & (COROUTINE_CHANNEL_HASH_SIZE -1)]);
+    struct hlist_head *head = coroutine_channel_head(cur_coroutine, channel_id);
     hlist_add_head(&(channel_node->node), head);
     return channel_id;
 }
@@ -732,10 +1880,22 @@ void channel_close(int64_t channel_id){
     assert(main_channel_pool);
     struct hlist_node *cur, *next;
     struct channel_node *channel_node;
-    struct hlist_head *head = &(cur_coroutine->channels[channel_id & (COROUTINE_CHANNEL_HASH_SIZE -1)]);
+    struct hlist_head *head = coroutine_channel_head(cur_coroutine, channel_id);
+    struct waiting_node *find_node = NULL;
+    struct receive_send_list_node *send_list_node;
+    int flags;
     hlist_for_each_entry_safe(channel_node, cur, next, head, node){
         if(channel_node->channel_id == channel_id){
+	    /* A subscriber which goes away may have been the one holding blocked senders back. */
+	    flags = main_channel_pool->getflags(main_channel_pool, channel_id);
+	    if(flags > 0 && (flags & CHANNEL_POOL_BROADCAST_BLOCK)){
+	        find_node = find_waiting_node(channel_id, 0);
+	    }
 	    main_channel_pool->close(main_channel_pool, channel_id);
+	    if(find_node && !list_empty(&(find_node->send_list))){
+	        send_list_node = list_entry(find_node->send_list.next, typeof(*send_list_node), node);
+	        resume_coroutine(send_list_node->coroutine);
+	    }
             break;
         }
     }
@@ -748,13 +1908,18 @@ void channel_unlink(char *name){
 
 int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double timeout){
     assert(main_channel_pool);
+    timeout = call_timeout(timeout);
     struct hlist_node *cur, *next;
     struct channel_node *channel_node;
     struct waiting_node *find_node = NULL;
-    struct hlist_head *head = &(cur_coroutine->channels[channel_id & (COROUTINE_CHANNEL_HASH_SIZE -1)]);
+    struct hlist_head *head = coroutine_channel_head(cur_coroutine, channel_id);
     int need_find = 1;
+    struct ring_channel *ring;
     hlist_for_each_entry_safe(channel_node, cur, next, head, node){
         if(channel_node->channel_id == channel_id){
+	    if((ring = main_channel_pool->getring(main_channel_pool, channel_id))){
+	        return ring_channel_receive(ring, msg_ptr, msg_len, timeout);
+	    }
 	    if(msg_len < main_channel_pool->getmsgsize(main_channel_pool, channel_id)){
                 return -1;
 	    }
@@ -763,6 +1928,9 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 		    errno = EAGAIN;
                     return -1;
 		}
+		if(coroutine_interrupted()){
+                    return -1;
+		}
 	        find_node = find_waiting_node(channel_id, 1);
                 struct receive_send_list_node receive_list_node;
 		receive_list_node.coroutine = cur_coroutine;
@@ -787,6 +1955,9 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 		    find_node = NULL;
 		    need_find = 0;
 	        }
+		if(coroutine_interrupted()){
+                    return -1;
+		}
 		if(main_channel_pool->isempty(main_channel_pool, channel_id)){
 		    return 0;
 		}
@@ -796,7 +1967,7 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 	        if(!find_node && need_find){
 	            find_node = find_waiting_node(channel_id, 0);
 		}
-		if(find_node && !list_empty(&(find_node->send_list))){
+		if(find_node && !list_empty(&(find_node->send_list)) && !main_channel_pool->isfull(main_channel_pool, channel_id)){
 	            struct receive_send_list_node *send_list_node = list_entry(find_node->send_list.next, typeof(*send_list_node), node);
 	            resume_coroutine(send_list_node->coroutine);
 		}
@@ -810,22 +1981,40 @@ int channel_receive(int64_t channel_id, char *msg_ptr, size_t msg_len, double ti
 
 int channel_send(int64_t channel_id, const char *msg_ptr, size_t msg_len, double timeout){
     assert(main_channel_pool);
+    timeout = call_timeout(timeout);
     struct hlist_node *cur, *next;
     struct channel_node *channel_node;
     struct waiting_node *find_node = NULL;
-    struct hlist_head *head = &(cur_coroutine->channels[channel_id & (COROUTINE_CHANNEL_HASH_SIZE -1)]);
+    struct hlist_head *head = coroutine_channel_head(cur_coroutine, channel_id);
     int need_find = 1;
+    struct ring_channel *ring;
     hlist_for_each_entry_safe(channel_node, cur, next, head, node){
         if(channel_node->channel_id == channel_id){
+	    if((ring = main_channel_pool->getring(main_channel_pool, channel_id))){
+	        return ring_channel_send(ring, msg_ptr, msg_len, timeout);
+	    }
 	    if(msg_len > main_channel_pool->getmsgsize(main_channel_pool, channel_id)){
                 return -1;
 	    }
-	    if(main_channel_pool->isfull(main_channel_pool, channel_id)){
+	    /*
+	     * A broadcast ring only has room once its slowest subscriber moves,
+	     * so a wakeup may find it still full: park again until the caller's
+	     * own timeout runs out.
+	     */
+	    double end_time = timeout > 0 ? co_time() + timeout : 0;
+	    while(main_channel_pool->isfull(main_channel_pool, channel_id)){
 	        if(timeout == 0){
 		    errno = EAGAIN;
                     return -1;
 		}
+		if(coroutine_interrupted()){
+                    return -1;
+		}
+		if(end_time > 0 && (timeout = end_time - co_time()) <= 0){
+		    return 0;
+		}
 	        find_node = find_waiting_node(channel_id, 1);
+		need_find = 1;
                 struct receive_send_list_node send_list_node;
 		send_list_node.coroutine = cur_coroutine;
 		list_add_before(&(send_list_node.node), &(find_node->send_list));
@@ -849,12 +2038,14 @@ int channel_send(int64_t channel_id, const char *msg_ptr, size_t msg_len, double
 		    find_node = NULL;
 		    need_find = 0;
 	        }
-		if(main_channel_pool->isfull(main_channel_pool, channel_id)){
-		    return 0;
+		if(coroutine_interrupted()){
+                    return -1;
 		}
-	    } 
+	    }
 	    int send_ret = main_channel_pool->send(main_channel_pool, channel_id, msg_ptr, msg_len);
-	    if(send_ret >= 0){
+	    if(send_ret >= 0 && (main_channel_pool->getflags(main_channel_pool, channel_id) & CHANNEL_POOL_BROADCAST)){
+	        wake_channel_waiter(channel_id, CO_SELECT_RECEIVE);
+	    } else if(send_ret >= 0){
 	        if(!find_node && need_find){
 	            find_node = find_waiting_node(channel_id, 0);
 		}
@@ -869,3 +2060,1559 @@ int channel_send(int64_t channel_id, const char *msg_ptr, size_t msg_len, double
     errno = EINVAL;
     return -1;
 }
+
+static void ring_channel_callback(struct event_loop *ev, int fd, int event_type, void *arg){
+    struct ring_channel *ring = arg;
+    struct receive_send_list_node *list_node;
+    uint64_t count;
+    while(ev->read(ev, fd, &count, sizeof(count)) > 0){
+    }
+    __atomic_store_n(&(ring->signaled), 0, __ATOMIC_SEQ_CST);
+    if(!list_empty(&(ring->receive_list))){
+        list_node = list_entry(ring->receive_list.next, typeof(*list_node), node);
+        wake_coroutine(list_node->coroutine);
+    }
+    if(!list_empty(&(ring->send_list))){
+        list_node = list_entry(ring->send_list.next, typeof(*list_node), node);
+        wake_coroutine(list_node->coroutine);
+    }
+}
+
+static int ring_channel_register(struct ring_channel *ring){
+    if(ring->ev){
+        return 0;
+    }
+    if(main_event_loop->add_reader(main_event_loop, ring->eventfd, ring_channel_callback, ring) < 0){
+        return -1;
+    }
+    ring->ev = main_event_loop;
+    list_add_before(&(ring->ev_node), &ring_channel_head);
+    return 0;
+}
+
+int ring_channel_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout){
+    assert(main_event_loop);
+    struct receive_send_list_node send_list_node;
+    struct timeout_node timeout_node;
+    int64_t timer_id = 0;
+    int ret;
+    timeout = call_timeout(timeout);
+    if((ret = ring_channel_try_send(ring, msg_ptr, msg_len)) >= 0){
+        ring_channel_notify(ring);
+        return ret;
+    }
+    if(errno != EAGAIN || timeout == 0 || coroutine_interrupted() || ring_channel_register(ring) < 0){
+        return -1;
+    }
+    timeout_node.fired = 0;
+    if(timeout > 0){
+        timer_id = add_timeout(&timeout_node, timeout);
+    }
+    if(ring_channel_add_waiter(ring) < 0){
+        if(timer_id > 0){
+            main_event_loop->remove_timer(main_event_loop, timer_id);
+        }
+        return -1;
+    }
+    send_list_node.coroutine = cur_coroutine;
+    list_add_before(&(send_list_node.node), &(ring->send_list));
+    while((ret = ring_channel_try_send(ring, msg_ptr, msg_len)) < 0 && !timeout_node.fired && !cur_coroutine->interrupted){
+        yield_coroutine();
+    }
+    ring_channel_del_waiter(ring);
+    list_del(&(send_list_node.node));
+    if(timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, timer_id);
+    }
+    if(ret < 0 && coroutine_interrupted()){
+        return -1;
+    }
+    if(ret < 0){
+        errno = 0;
+        return 0;
+    }
+    ring_channel_notify(ring);
+    return ret;
+}
+
+int ring_channel_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout){
+    assert(main_event_loop);
+    struct receive_send_list_node receive_list_node;
+    struct timeout_node timeout_node;
+    int64_t timer_id = 0;
+    int ret;
+    timeout = call_timeout(timeout);
+    if((ret = ring_channel_try_receive(ring, msg_ptr, msg_len)) >= 0){
+        ring_channel_notify(ring);
+        return ret;
+    }
+    if(errno != EAGAIN || timeout == 0 || coroutine_interrupted() || ring_channel_register(ring) < 0){
+        return -1;
+    }
+    timeout_node.fired = 0;
+    if(timeout > 0){
+        timer_id = add_timeout(&timeout_node, timeout);
+    }
+    if(ring_channel_add_waiter(ring) < 0){
+        if(timer_id > 0){
+            main_event_loop->remove_timer(main_event_loop, timer_id);
+        }
+        return -1;
+    }
+    receive_list_node.coroutine = cur_coroutine;
+    list_add_before(&(receive_list_node.node), &(ring->receive_list));
+    while((ret = ring_channel_try_receive(ring, msg_ptr, msg_len)) < 0 && !timeout_node.fired && !cur_coroutine->interrupted){
+        yield_coroutine();
+    }
+    ring_channel_del_waiter(ring);
+    list_del(&(receive_list_node.node));
+    if(timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, timer_id);
+    }
+    if(ret < 0 && coroutine_interrupted()){
+        return -1;
+    }
+    if(ret < 0){
+        errno = 0;
+        return 0;
+    }
+    ring_channel_notify(ring);
+    return ret;
+}
+
+static int channel_is_open(int64_t channel_id){
+    struct hlist_node *cur, *next;
+    struct channel_node *channel_node;
+    struct hlist_head *head = coroutine_channel_head(cur_coroutine, channel_id);
+    hlist_for_each_entry_safe(channel_node, cur, next, head, node){
+        if(channel_node->channel_id == channel_id){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Wake the first waiter of a channel; a broadcast message wakes every
+ * receiver which was parked when it was sent. Senders are only woken once
+ * there is room, which on a blocking broadcast channel means once its
+ * slowest subscriber moved. A woken coroutine unlinks
+ * itself (and may free the waiting node), so look the list up each time.
+ */
+static void wake_channel_waiter(int64_t channel_id, int type){
+    struct waiting_node *find_node = find_waiting_node(channel_id, 0);
+    struct list_head *head, *pos;
+    struct receive_send_list_node *list_node;
+    int count = 1;
+    if(!find_node){
+        return;
+    }
+    if(type == CO_SELECT_SEND && main_channel_pool->isfull(main_channel_pool, channel_id)){
+        return;
+    }
+    head = (type == CO_SELECT_SEND) ? &(find_node->send_list) : &(find_node->receive_list);
+    if(type == CO_SELECT_RECEIVE && (main_channel_pool->getflags(main_channel_pool, channel_id) & CHANNEL_POOL_BROADCAST)){
+        count = 0;
+        list_for_each(pos, head){
+            count++;
+        }
+    }
+    while(count-- > 0 && (find_node = find_waiting_node(channel_id, 0))){
+        head = (type == CO_SELECT_SEND) ? &(find_node->send_list) : &(find_node->receive_list);
+        if(list_empty(head)){
+            break;
+        }
+        list_node = list_entry(head->next, typeof(*list_node), node);
+        resume_coroutine(list_node->coroutine);
+    }
+}
+
+/*
+ * Scan the cases in order and complete the first one which is ready. The
+ * fd cases are probed together with a single zero-timeout poll().
+ */
+static int select_ready(struct co_select_case *cases, int ncases, struct pollfd *pollfds){
+    int i, npoll = 0, polled = 0;
+    ssize_t ret;
+    for(i = 0; i < ncases; i++){
+        if(cases[i].type == CO_SELECT_READ || cases[i].type == CO_SELECT_WRITE){
+            pollfds[npoll].fd = cases[i].fd;
+            pollfds[npoll].events = (cases[i].type == CO_SELECT_READ) ? POLLIN : POLLOUT;
+            pollfds[npoll].revents = 0;
+            npoll++;
+        }
+    }
+    if(npoll){
+        while((polled = poll(pollfds, npoll, 0)) < 0 && errno == EINTR){
+        }
+    }
+    for(i = 0, npoll = 0; i < ncases; i++){
+        switch(cases[i].type){
+            case CO_SELECT_RECEIVE:
+                ret = main_channel_pool->receive(main_channel_pool, cases[i].channel_id, cases[i].msg_ptr, cases[i].msg_len);
+                if(ret >= 0 || errno != EAGAIN){
+                    cases[i].ret = ret;
+                    if(ret >= 0 && !main_channel_pool->getring(main_channel_pool, cases[i].channel_id)){
+                        wake_channel_waiter(cases[i].channel_id, CO_SELECT_SEND);
+                    }
+                    return i;
+                }
+                break;
+            case CO_SELECT_SEND:
+                ret = main_channel_pool->send(main_channel_pool, cases[i].channel_id, cases[i].msg_ptr, cases[i].msg_len);
+                if(ret >= 0 || errno != EAGAIN){
+                    cases[i].ret = ret;
+                    if(ret >= 0 && !main_channel_pool->getring(main_channel_pool, cases[i].channel_id)){
+                        wake_channel_waiter(cases[i].channel_id, CO_SELECT_RECEIVE);
+                    }
+                    return i;
+                }
+                break;
+            default:
+                if(polled > 0 && pollfds[npoll].revents){
+                    cases[i].ret = pollfds[npoll].revents;
+                    return i;
+                }
+                npoll++;
+                break;
+        }
+    }
+    return -1;
+}
+
+static int select_register(struct co_select_case *cases, int ncases, struct select_node *select_nodes){
+    int i;
+    struct select_node *select_node;
+    for(i = 0; i < ncases; i++){
+        select_node = &select_nodes[i];
+        select_node->list_node.coroutine = cur_coroutine;
+        select_node->waiting_node = NULL;
+        select_node->ring = NULL;
+        switch(cases[i].type){
+            case CO_SELECT_RECEIVE:
+            case CO_SELECT_SEND:
+                if((select_node->ring = main_channel_pool->getring(main_channel_pool, cases[i].channel_id))){
+                    if(ring_channel_register(select_node->ring) < 0 || ring_channel_add_waiter(select_node->ring) < 0){
+                        select_node->ring = NULL;
+                        select_unregister(cases, i, select_nodes);
+                        return -1;
+                    }
+                    list_add_before(&(select_node->list_node.node), (cases[i].type == CO_SELECT_RECEIVE) ? &(select_node->ring->receive_list) : &(select_node->ring->send_list));
+                } else {
+                    select_node->waiting_node = find_waiting_node(cases[i].channel_id, 1);
+                    list_add_before(&(select_node->list_node.node), (cases[i].type == CO_SELECT_RECEIVE) ? &(select_node->waiting_node->receive_list) : &(select_node->waiting_node->send_list));
+                }
+                break;
+            case CO_SELECT_READ:
+                main_event_loop->add_reader(main_event_loop, cases[i].fd, reader_writer_callback, cur_coroutine);
+                break;
+            case CO_SELECT_WRITE:
+                main_event_loop->add_writer(main_event_loop, cases[i].fd, reader_writer_callback, cur_coroutine);
+                break;
+        }
+    }
+    return 0;
+}
+
+static void select_unregister(struct co_select_case *cases, int ncases, struct select_node *select_nodes){
+    int i;
+    struct select_node *select_node;
+    for(i = 0; i < ncases; i++){
+        select_node = &select_nodes[i];
+        switch(cases[i].type){
+            case CO_SELECT_RECEIVE:
+            case CO_SELECT_SEND:
+                list_del(&(select_node->list_node.node));
+                if(select_node->ring){
+                    ring_channel_del_waiter(select_node->ring);
+                } else if(list_empty(&(select_node->waiting_node->receive_list)) && list_empty(&(select_node->waiting_node->send_list))){
+                    hlist_del(&(select_node->waiting_node->node));
+                    free(select_node->waiting_node);
+                }
+                break;
+            case CO_SELECT_READ:
+                main_event_loop->remove_reader(main_event_loop, cases[i].fd, cur_coroutine);
+                break;
+            case CO_SELECT_WRITE:
+                main_event_loop->remove_writer(main_event_loop, cases[i].fd, cur_coroutine);
+                break;
+        }
+    }
+}
+
+/*
+ * A sender or receiver only wakes the first waiter of a channel. If that
+ * was us but another case won, hand the wakeup on to the next waiter.
+ */
+static void select_pass_wakeups(struct co_select_case *cases, int ncases, int selected){
+    int i;
+    struct ring_channel *ring;
+    for(i = 0; i < ncases; i++){
+        if(i == selected || (cases[i].type != CO_SELECT_RECEIVE && cases[i].type != CO_SELECT_SEND)){
+            continue;
+        }
+        if((ring = main_channel_pool->getring(main_channel_pool, cases[i].channel_id))){
+            ring_channel_notify(ring);
+        } else if(cases[i].type == CO_SELECT_RECEIVE && !main_channel_pool->isempty(main_channel_pool, cases[i].channel_id)){
+            wake_channel_waiter(cases[i].channel_id, CO_SELECT_RECEIVE);
+        } else if(cases[i].type == CO_SELECT_SEND && !main_channel_pool->isfull(main_channel_pool, cases[i].channel_id)){
+            wake_channel_waiter(cases[i].channel_id, CO_SELECT_SEND);
+        }
+    }
+}
+
+int co_select(struct co_select_case *cases, int ncases, double timeout){
+    assert(main_event_loop);
+    timeout = call_timeout(timeout);
+    struct timeout_node timeout_node;
+    int64_t timer_id = 0;
+    int i, selected, parked = 0;
+    if(ncases <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    for(i = 0; i < ncases; i++){
+        switch(cases[i].type){
+            case CO_SELECT_RECEIVE:
+            case CO_SELECT_SEND:
+                if(!channel_is_open(cases[i].channel_id)){
+                    errno = EINVAL;
+                    return -1;
+                }
+                break;
+            case CO_SELECT_READ:
+            case CO_SELECT_WRITE:
+                break;
+            default:
+                errno = EINVAL;
+                return -1;
+        }
+    }
+    struct pollfd pollfds[ncases];
+    struct select_node select_nodes[ncases];
+    timeout_node.fired = 0;
+    while((selected = select_ready(cases, ncases, pollfds)) < 0){
+        if(timeout == 0){
+            errno = EAGAIN;
+            break;
+        }
+        if(timeout_node.fired){
+            errno = ETIMEDOUT;
+            break;
+        }
+        if(coroutine_interrupted()){
+            break;
+        }
+        if(timeout > 0 && !timer_id){
+            timer_id = add_timeout(&timeout_node, timeout);
+        }
+        if(select_register(cases, ncases, select_nodes) < 0){
+            break;
+        }
+        parked = 1;
+        yield_coroutine();
+        select_unregister(cases, ncases, select_nodes);
+    }
+    if(timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, timer_id);
+    }
+    if(parked){
+        select_pass_wakeups(cases, ncases, selected);
+    }
+    return selected;
+}
+
+/*
+ * Park the current coroutine on waiters until wake_waiter() picks it or
+ * the timeout expires. The waker only queues the coroutine on its ready
+ * queue, so a wakeup costs no system call and no allocation.
+ */
+static int wait_on(struct list_head *waiters, double timeout, int interruptible){
+    struct co_waiter waiter;
+    struct timeout_node timeout_node;
+    int64_t timer_id = 0;
+    timeout = call_timeout(timeout);
+    if(timeout == 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    if(interruptible && coroutine_interrupted()){
+        return -1;
+    }
+    waiter.coroutine = cur_coroutine;
+    waiter.woken = 0;
+    timeout_node.fired = 0;
+    list_add_before(&(waiter.node), waiters);
+    if(timeout > 0){
+        timer_id = add_timeout(&timeout_node, timeout);
+    }
+    while(!waiter.woken && !timeout_node.fired && !(interruptible && cur_coroutine->interrupted)){
+        yield_coroutine();
+    }
+    if(timer_id > 0 && !timeout_node.fired){
+        main_event_loop->remove_timer(main_event_loop, timer_id);
+    }
+    if(!waiter.woken){
+        list_del(&(waiter.node));
+        errno = timeout_node.fired ? ETIMEDOUT : cur_coroutine->interrupted;
+        return -1;
+    }
+    return 0;
+}
+
+static void wake_waiter(struct list_head *waiters){
+    struct co_waiter *waiter = list_entry(waiters->next, struct co_waiter, node);
+    list_del(&(waiter->node));
+    waiter->woken = 1;
+    ready_coroutine(waiter->coroutine);
+}
+
+struct co_mutex *co_mutex_create(){
+    struct co_mutex *mutex = calloc(1, sizeof(struct co_mutex));
+    if(!mutex){
+        return NULL;
+    }
+    INIT_LIST_HEAD(&(mutex->waiters));
+    return mutex;
+}
+
+int co_mutex_destroy(struct co_mutex *mutex){
+    if(mutex->owner || !list_empty(&(mutex->waiters))){
+        errno = EBUSY;
+        return -1;
+    }
+    free(mutex);
+    return 0;
+}
+
+int co_mutex_lock(struct co_mutex *mutex){
+    assert(main_event_loop);
+    if(mutex->owner == cur_coroutine){
+        errno = EDEADLK;
+        return -1;
+    }
+    if(!mutex->owner){
+        mutex->owner = cur_coroutine;
+        return 0;
+    }
+    /* co_mutex_unlock() hands the mutex straight to the first waiter. */
+    return wait_on(&(mutex->waiters), -1, 0);
+}
+
+int co_mutex_trylock(struct co_mutex *mutex){
+    if(mutex->owner){
+        errno = EBUSY;
+        return -1;
+    }
+    mutex->owner = cur_coroutine;
+    return 0;
+}
+
+int co_mutex_unlock(struct co_mutex *mutex){
+    if(mutex->owner != cur_coroutine){
+        errno = EPERM;
+        return -1;
+    }
+    if(list_empty(&(mutex->waiters))){
+        mutex->owner = NULL;
+    } else {
+        mutex->owner = list_entry(mutex->waiters.next, struct co_waiter, node)->coroutine;
+        wake_waiter(&(mutex->waiters));
+    }
+    return 0;
+}
+
+struct co_cond *co_cond_create(){
+    struct co_cond *cond = calloc(1, sizeof(struct co_cond));
+    if(!cond){
+        return NULL;
+    }
+    INIT_LIST_HEAD(&(cond->waiters));
+    return cond;
+}
+
+int co_cond_destroy(struct co_cond *cond){
+    if(!list_empty(&(cond->waiters))){
+        errno = EBUSY;
+        return -1;
+    }
+    free(cond);
+    return 0;
+}
+
+int co_cond_wait(struct co_cond *cond, struct co_mutex *mutex, double timeout){
+    assert(main_event_loop);
+    int ret;
+    if(co_mutex_unlock(mutex) < 0){
+        return -1;
+    }
+    ret = wait_on(&(cond->waiters), timeout, 1);
+    co_mutex_lock(mutex);
+    return ret;
+}
+
+void co_cond_signal(struct co_cond *cond){
+    if(!list_empty(&(cond->waiters))){
+        wake_waiter(&(cond->waiters));
+    }
+}
+
+void co_cond_broadcast(struct co_cond *cond){
+    while(!list_empty(&(cond->waiters))){
+        wake_waiter(&(cond->waiters));
+    }
+}
+
+struct co_sem *co_sem_create(int64_t value){
+    struct co_sem *sem;
+    if(value < 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    sem = calloc(1, sizeof(struct co_sem));
+    if(!sem){
+        return NULL;
+    }
+    sem->value = value;
+    INIT_LIST_HEAD(&(sem->waiters));
+    return sem;
+}
+
+int co_sem_destroy(struct co_sem *sem){
+    if(!list_empty(&(sem->waiters))){
+        errno = EBUSY;
+        return -1;
+    }
+    free(sem);
+    return 0;
+}
+
+int co_sem_wait(struct co_sem *sem, double timeout){
+    assert(main_event_loop);
+    if(sem->value > 0){
+        sem->value -= 1;
+        return 0;
+    }
+    /* co_sem_post() hands its unit straight to the first waiter. */
+    return wait_on(&(sem->waiters), timeout, 1);
+}
+
+void co_sem_post(struct co_sem *sem){
+    if(list_empty(&(sem->waiters))){
+        sem->value += 1;
+    } else {
+        wake_waiter(&(sem->waiters));
+    }
+}
+
+struct co_waitgroup *co_waitgroup_create(){
+    struct co_waitgroup *wg = calloc(1, sizeof(struct co_waitgroup));
+    if(!wg){
+        return NULL;
+    }
+    INIT_LIST_HEAD(&(wg->waiters));
+    return wg;
+}
+
+int co_waitgroup_destroy(struct co_waitgroup *wg){
+    if(!list_empty(&(wg->waiters))){
+        errno = EBUSY;
+        return -1;
+    }
+    free(wg);
+    return 0;
+}
+
+int co_waitgroup_add(struct co_waitgroup *wg, int64_t delta){
+    if(wg->count + delta < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    wg->count += delta;
+    if(!wg->count){
+        while(!list_empty(&(wg->waiters))){
+            wake_waiter(&(wg->waiters));
+        }
+    }
+    return 0;
+}
+
+void co_waitgroup_done(struct co_waitgroup *wg){
+    co_waitgroup_add(wg, -1);
+}
+
+int co_waitgroup_wait(struct co_waitgroup *wg, double timeout){
+    assert(main_event_loop);
+    if(!wg->count){
+        return 0;
+    }
+    return wait_on(&(wg->waiters), timeout, 1);
+}
+
+/*
+ * A pool worker lives across tasks so its stack stays mapped and warm.
+ * Whatever a task left on the coroutine (channels, deadline, interrupt,
+ * priority) is reset before the next task starts.
+ */
+static void pool_worker(void *arg){
+    struct co_pool *pool = arg;
+    struct co_pool_task *task;
+    void (*routine)(void *);
+    void *task_arg;
+    int priority = cur_coroutine->priority;
+    while(1){
+        while(list_empty(&(pool->tasks)) && !pool->closing){
+            wait_on(&(pool->idle_workers), -1, 0);
+        }
+        if(list_empty(&(pool->tasks))){
+            break;
+        }
+        task = list_entry(pool->tasks.next, struct co_pool_task, node);
+        routine = task->routine;
+        task_arg = task->arg;
+        list_move_after(&(task->node), &(pool->free_tasks));
+        routine(task_arg);
+        if(cur_coroutine->stack_profiled){
+            size_t used = stack_usage(cur_coroutine);
+            record_stack_usage(routine, used);
+            repaint_stack(cur_coroutine, used);
+        }
+        run_key_destructors(cur_coroutine);
+        release_arena(cur_coroutine);
+        close_coroutine_channels(cur_coroutine);
+        if(cur_coroutine->deadline || cur_coroutine->interrupted){
+            co_set_deadline(0);
+            cur_coroutine->interrupted = 0;
+        }
+        if(cur_coroutine->priority != priority){
+            co_set_priority(cur_coroutine->id, priority);
+        }
+    }
+    pool->workers -= 1;
+    if(!pool->workers){
+        free_pool(pool);
+    }
+}
+
+static void free_pool(struct co_pool *pool){
+    struct co_pool_task *task, *next;
+    list_for_each_entry_safe(task, next, &(pool->free_tasks), node){
+        free(task);
+    }
+    free(pool);
+}
+
+struct co_pool *co_pool_create(int workers, uint32_t stack_size){
+    assert(main_event_loop);
+    struct co_pool *pool;
+    if(workers <= 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    pool = calloc(1, sizeof(struct co_pool));
+    if(!pool){
+        return NULL;
+    }
+    pool->stack_size = stack_size;
+    pool->max_workers = workers;
+    INIT_LIST_HEAD(&(pool->tasks));
+    INIT_LIST_HEAD(&(pool->free_tasks));
+    INIT_LIST_HEAD(&(pool->idle_workers));
+    while(pool->workers < workers){
+        pool->workers += 1;
+        if(make_coroutine(stack_size, pool_worker, pool, NULL) < 0){
+            pool->workers -= 1;
+            break;
+        }
+    }
+    if(!pool->workers){
+        free_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int co_pool_set_max_workers(struct co_pool *pool, int max_workers){
+    if(max_workers <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    pool->max_workers = max_workers;
+    return 0;
+}
+
+int co_go(struct co_pool *pool, void (*routine)(void *), void *arg){
+    assert(main_event_loop);
+    struct co_pool_task *task;
+    if(pool->closing){
+        errno = EINVAL;
+        return -1;
+    }
+    if(!list_empty(&(pool->free_tasks))){
+        task = list_entry(pool->free_tasks.next, struct co_pool_task, node);
+        list_del(&(task->node));
+    } else if(!(task = malloc(sizeof(struct co_pool_task)))){
+        return -1;
+    }
+    task->routine = routine;
+    task->arg = arg;
+    list_add_before(&(task->node), &(pool->tasks));
+    if(!list_empty(&(pool->idle_workers))){
+        wake_waiter(&(pool->idle_workers));
+    } else if(pool->workers < pool->max_workers){
+        pool->workers += 1;
+        if(make_coroutine(pool->stack_size, pool_worker, pool, NULL) < 0){
+            pool->workers -= 1;
+        }
+    }
+    return 0;
+}
+
+void co_pool_destroy(struct co_pool *pool){
+    pool->closing = 1;
+    while(!list_empty(&(pool->idle_workers))){
+        wake_waiter(&(pool->idle_workers));
+    }
+}
+
+/*
+ * Count the resident bytes of the page aligned range [start, end) and
+ * report the lowest resident page, i.e. how deep the stack ever grew.
+ */
+static size_t stack_resident_bytes(char *start, char *end, char **lowest){
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    unsigned char vec[STACK_MINCORE_CHUNK];
+    size_t i, pages, bytes = 0;
+    if(lowest){
+        *lowest = NULL;
+    }
+    while(start < end){
+        pages = (end - start) / page_size;
+        if(pages > STACK_MINCORE_CHUNK){
+            pages = STACK_MINCORE_CHUNK;
+        }
+        if(mincore(start, pages * page_size, vec) < 0){
+            break;
+        }
+        for(i = 0; i < pages; i++){
+            if(vec[i] & 1){
+                bytes += page_size;
+                if(lowest && !*lowest){
+                    *lowest = start + i * page_size;
+                }
+            }
+        }
+        start += pages * page_size;
+    }
+    return bytes;
+}
+
+/*
+ * Everything below the saved stack pointer of a parked coroutine is
+ * dead, so those pages can go back to the kernel; they come back zero
+ * filled if the coroutine ever recurses that deep again. One page under
+ * the stack pointer is kept for the red zone.
+ */
+static void reclaim_stack(struct coroutine *coroutine){
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    char *bottom = (char *)coroutine->mem_base + page_size;
+    char *limit = (char *)((uintptr_t)coroutine->stack_pointer & ~(uintptr_t)(page_size - 1)) - page_size;
+    size_t bytes;
+    coroutine->stack_reclaimed = 1;
+    if(limit <= bottom){
+        return;
+    }
+    bytes = stack_resident_bytes(bottom, limit, NULL);
+    if(bytes && madvise(bottom, limit - bottom, MADV_DONTNEED) == 0){
+        stack_reclaimed_bytes += bytes;
+    }
+}
+
+static int stack_reclaim_callback(struct event_loop *ev, int64_t timer_id, void *arg){
+    int i;
+    double now = co_time();
+    struct hlist_node *cur;
+    struct coroutine *coroutine;
+    for(i = 0; i < COROUTINE_HASH_SIZE; i++){
+        hlist_for_each_entry(coroutine, cur, &coroutine_hash[i], hash_node){
+            if(list_empty(&(coroutine->list_node)) && !coroutine->stack_reclaimed && !coroutine->stack_profiled && coroutine->parked_at > 0 && now - coroutine->parked_at >= stack_reclaim_idle){
+                reclaim_stack(coroutine);
+            }
+        }
+    }
+    return 1;
+}
+
+static int arm_stack_reclaim(){
+    struct timespec ts;
+    double interval = stack_reclaim_idle / 2;
+    if(stack_reclaim_timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, stack_reclaim_timer_id);
+        stack_reclaim_timer_id = 0;
+    }
+    if(stack_reclaim_idle <= 0){
+        return 0;
+    }
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec) * 1000000000);
+    stack_reclaim_timer_id = main_event_loop->add_timer(main_event_loop, &ts, stack_reclaim_callback, NULL);
+    if(stack_reclaim_timer_id < 0){
+        stack_reclaim_timer_id = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int co_set_stack_reclaim(double idle_seconds){
+    if(idle_seconds < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    stack_reclaim_idle = idle_seconds;
+    if(main_event_loop){
+        return arm_stack_reclaim();
+    }
+    return 0;
+}
+
+int co_get_stack_stats(struct co_stack_stats *stats){
+    int i;
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    struct hlist_node *cur;
+    struct coroutine *coroutine;
+    memset(stats, 0, sizeof(struct co_stack_stats));
+    stats->reclaimed_bytes = stack_reclaimed_bytes;
+    if(!main_event_loop){
+        return 0;
+    }
+    for(i = 0; i < COROUTINE_HASH_SIZE; i++){
+        hlist_for_each_entry(coroutine, cur, &coroutine_hash[i], hash_node){
+            stats->coroutines += 1;
+            stats->reserved_bytes += coroutine->mem_size - page_size;
+            stats->resident_bytes += stack_resident_bytes((char *)coroutine->mem_base + page_size, (char *)coroutine->mem_base + coroutine->mem_size, NULL);
+        }
+    }
+    return 0;
+}
+
+ssize_t co_stack_high_water(int64_t co_id){
+    assert(main_event_loop);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    struct coroutine *coroutine = find_coroutine(co_id);
+    char *top, *lowest;
+    if(!coroutine){
+        errno = ESRCH;
+        return -1;
+    }
+    top = (char *)coroutine->mem_base + coroutine->mem_size;
+    stack_resident_bytes((char *)coroutine->mem_base + page_size, top, &lowest);
+    return lowest ? top - lowest : 0;
+}
+
+/*
+ * Profiled stacks are painted with STACK_CANARY when they are mapped, so
+ * the deepest point a coroutine reached is the first word, counted from
+ * the bottom, which no longer holds the pattern.
+ */
+static size_t stack_usage(struct coroutine *coroutine){
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    uint64_t *cur = (uint64_t *)((char *)coroutine->mem_base + page_size);
+    uint64_t *top = (uint64_t *)coroutine;
+    while(cur < top && *cur == STACK_CANARY_WORD){
+        cur++;
+    }
+    return (char *)top - (char *)cur;
+}
+
+/*
+ * A pool worker keeps its stack across tasks, so the part the last task
+ * dirtied is painted again. The frames of this function and of memset()
+ * live just below the frame address, hence the margin left untouched.
+ */
+static __attribute__((noinline)) void repaint_stack(struct coroutine *coroutine, size_t used){
+    char *start = (char *)coroutine - used;
+    char *end = (char *)__builtin_frame_address(0) - STACK_REPAINT_MARGIN;
+    if(start < end){
+        memset(start, STACK_CANARY, end - start);
+    }
+}
+
+static void record_stack_usage(void (*routine)(void *), size_t used){
+    int i;
+    struct stack_profile *profile;
+    list_for_each_entry(profile, &stack_profiles, node){
+        if(profile->routine == routine){
+            goto found;
+        }
+    }
+    profile = calloc(1, sizeof(struct stack_profile));
+    if(!profile){
+        return;
+    }
+    profile->routine = routine;
+    INIT_LIST_HEAD(&(profile->node));
+found:
+    list_move_after(&(profile->node), &stack_profiles);
+    profile->count += 1;
+    profile->total_used += used;
+    if(used > profile->max_used){
+        profile->max_used = used;
+    }
+    for(i = 0; i < STACK_PROFILE_BUCKETS - 1 && used > ((size_t)STACK_PROFILE_MIN_BUCKET << i); i++);
+    profile->buckets[i] += 1;
+}
+
+int co_set_stack_profile(int enable){
+    stack_profile_enabled = enable ? 1 : 0;
+    return 0;
+}
+
+int co_stack_profile_dump(int fd){
+    int i;
+    Dl_info info;
+    const char *name;
+    struct stack_profile *profile;
+    list_for_each_entry(profile, &stack_profiles, node){
+        name = dladdr((void *)profile->routine, &info) && info.dli_sname ? info.dli_sname : "?";
+        if(dprintf(fd, "%s (%p): count %lu, max %zu, avg %lu\n", name, (void *)profile->routine, profile->count, profile->max_used, profile->total_used / profile->count) < 0){
+            return -1;
+        }
+        for(i = 0; i < STACK_PROFILE_BUCKETS; i++){
+            if(!profile->buckets[i]){
+                continue;
+            }
+            if(dprintf(fd, "    %s%7zuK %lu\n", i == STACK_PROFILE_BUCKETS - 1 ? ">" : "<=", (size_t)(STACK_PROFILE_MIN_BUCKET << (i == STACK_PROFILE_BUCKETS - 1 ? i - 1 : i)) / 1024, profile->buckets[i]) < 0){
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * The CO_MEM_* flags have the values of the MEM_PLACEMENT_* flags, so
+ * they are handed to mem_placement_map() as they are.
+ */
+int co_set_mem_placement(int flags){
+    if(flags & ~(CO_MEM_HUGEPAGE | CO_MEM_HUGETLB | CO_MEM_NUMA_LOCAL | CO_MEM_POPULATE)){
+        errno = EINVAL;
+        return -1;
+    }
+    mem_placement_flags = flags;
+    return 0;
+}
+
+static void add_slab_stats(struct co_slab_stats *stats, struct slab_cache *cache){
+    stats->in_use += cache->in_use;
+    stats->free_objects += cache->free_objects;
+    stats->allocs += cache->allocs;
+    stats->block_bytes += cache->block_bytes;
+}
+
+int co_get_slab_stats(struct co_slab_stats *stats){
+    assert(main_event_loop);
+    memset(stats, 0, sizeof(struct co_slab_stats));
+    add_slab_stats(stats, &(main_event_loop->fd_node_cache));
+    add_slab_stats(stats, &(main_event_loop->fd_waiter_cache));
+    add_slab_stats(stats, &(main_event_loop->timer_node_cache));
+    add_slab_stats(stats, &(main_event_loop->defer_node_cache));
+    add_slab_stats(stats, &(main_event_loop->timer_heap->node_cache));
+    add_slab_stats(stats, &(main_event_loop->timer_heap->value_cache));
+    return 0;
+}
+
+/*
+ * Standard chunks go back to a process wide free list, so a coroutine
+ * which allocates a few kilobytes per request does not touch malloc once
+ * the list is warm. Oversized chunks are freed.
+ */
+static void release_arena(struct coroutine *coroutine){
+    struct arena_chunk *chunk;
+    while(coroutine->arena){
+        chunk = coroutine->arena;
+        coroutine->arena = chunk->next;
+        if(chunk->size == ARENA_CHUNK_SIZE && arena_free_chunk_count < ARENA_MAX_FREE_CHUNKS){
+            chunk->next = arena_free_chunks;
+            arena_free_chunks = chunk;
+            arena_free_chunk_count += 1;
+        } else {
+            free(chunk);
+        }
+    }
+}
+
+void *co_arena_alloc(size_t size){
+    struct arena_chunk *chunk = cur_coroutine->arena;
+    size_t chunk_size;
+    void *ptr;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(!chunk || chunk->size - chunk->used < size){
+        chunk_size = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+        if(chunk_size == ARENA_CHUNK_SIZE && arena_free_chunks){
+            chunk = arena_free_chunks;
+            arena_free_chunks = chunk->next;
+            arena_free_chunk_count -= 1;
+        } else {
+            chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+            if(!chunk){
+                return NULL;
+            }
+            chunk->size = chunk_size;
+        }
+        chunk->used = 0;
+        /*
+         * An oversized chunk is full at once, so it goes behind the
+         * current chunk, which keeps serving the small allocations.
+         */
+        if(chunk_size != ARENA_CHUNK_SIZE && cur_coroutine->arena){
+            chunk->next = cur_coroutine->arena->next;
+            cur_coroutine->arena->next = chunk;
+        } else {
+            chunk->next = cur_coroutine->arena;
+            cur_coroutine->arena = chunk;
+        }
+    }
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void co_arena_reset(){
+    release_arena(cur_coroutine);
+}
+
+/*
+ * Like pthread keys: a destructor may store new values, so the slots are
+ * scanned again, a bounded number of times. Values left without a
+ * destructor are dropped, since pool workers reuse the coroutine.
+ */
+static void run_key_destructors(struct coroutine *coroutine){
+    int i, round, again = 1;
+    void *value;
+    for(round = 0; round < KEY_DESTRUCTOR_ROUNDS && again; round++){
+        again = 0;
+        for(i = 0; i < CO_KEYS_MAX; i++){
+            if(coroutine->specific[i] && key_destructors[i]){
+                value = coroutine->specific[i];
+                coroutine->specific[i] = NULL;
+                key_destructors[i](value);
+                again = 1;
+            }
+        }
+    }
+    memset(coroutine->specific, 0, sizeof(coroutine->specific));
+}
+
+int co_key_create(int *key, void (*destructor)(void *value)){
+    int i;
+    for(i = 0; i < CO_KEYS_MAX; i++){
+        if(!key_in_use[i]){
+            key_in_use[i] = 1;
+            key_destructors[i] = destructor;
+            *key = i;
+            return 0;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int co_key_delete(int key){
+    int i;
+    struct hlist_node *cur;
+    struct coroutine *coroutine;
+    if(key < 0 || key >= CO_KEYS_MAX || !key_in_use[key]){
+        errno = EINVAL;
+        return -1;
+    }
+    key_in_use[key] = 0;
+    key_destructors[key] = NULL;
+    main_coroutine.specific[key] = NULL;
+    if(main_event_loop){
+        for(i = 0; i < COROUTINE_HASH_SIZE; i++){
+            hlist_for_each_entry(coroutine, cur, &coroutine_hash[i], hash_node){
+                coroutine->specific[key] = NULL;
+            }
+        }
+    }
+    return 0;
+}
+
+void *co_getspecific(int key){
+    if((unsigned int)key >= CO_KEYS_MAX){
+        return NULL;
+    }
+    return cur_coroutine->specific[key];
+}
+
+int co_setspecific(int key, const void *value){
+    if((unsigned int)key >= CO_KEYS_MAX || !key_in_use[key]){
+        errno = EINVAL;
+        return -1;
+    }
+    cur_coroutine->specific[key] = (void *)value;
+    return 0;
+}
+
+static void *blocking_worker(void *arg){
+    struct blocking_pool *pool = arg;
+    struct blocking_task *task;
+    uint64_t one = 1;
+    pthread_mutex_lock(&(pool->lock));
+    while(1){
+        while(list_empty(&(pool->tasks)) && !pool->stopping){
+            pool->idle_threads += 1;
+            pthread_cond_wait(&(pool->cond), &(pool->lock));
+            pool->idle_threads -= 1;
+        }
+        if(list_empty(&(pool->tasks))){
+            break;
+        }
+        task = list_entry(pool->tasks.next, struct blocking_task, node);
+        list_del(&(task->node));
+        pthread_mutex_unlock(&(pool->lock));
+        errno = 0;
+        task->result = task->fn(task->arg);
+        task->err = errno;
+        pthread_mutex_lock(&(pool->lock));
+        list_add_before(&(task->node), &(pool->done));
+        write(pool->eventfd, &one, sizeof(one));
+    }
+    pool->threads -= 1;
+    pthread_cond_signal(&(pool->exit_cond));
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+}
+
+static void blocking_done_callback(struct event_loop *ev, int fd, int event_type, void *arg){
+    struct blocking_pool *pool = arg;
+    struct blocking_task *task, *next;
+    struct list_head done;
+    uint64_t count;
+    while(ev->read(ev, fd, &count, sizeof(count)) > 0){
+    }
+    INIT_LIST_HEAD(&done);
+    pthread_mutex_lock(&(pool->lock));
+    list_join(&(pool->done), &done);
+    pthread_mutex_unlock(&(pool->lock));
+    list_for_each_entry_safe(task, next, &done, node){
+        list_del(&(task->node));
+        task->done = 1;
+        wake_coroutine(task->coroutine);
+    }
+}
+
+static int start_blocking_pool(){
+    struct blocking_pool *pool = &blocking_pool;
+    if(pool->eventfd >= 0){
+        return 0;
+    }
+    pool->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(pool->eventfd < 0){
+        return -1;
+    }
+    if(main_event_loop->add_reader(main_event_loop, pool->eventfd, blocking_done_callback, pool) < 0){
+        close(pool->eventfd);
+        pool->eventfd = -1;
+        return -1;
+    }
+    INIT_LIST_HEAD(&(pool->tasks));
+    INIT_LIST_HEAD(&(pool->done));
+    pool->stopping = 0;
+    return 0;
+}
+
+static void stop_blocking_pool(){
+    struct blocking_pool *pool = &blocking_pool;
+    if(pool->eventfd < 0){
+        return;
+    }
+    pthread_mutex_lock(&(pool->lock));
+    pool->stopping = 1;
+    pthread_cond_broadcast(&(pool->cond));
+    while(pool->threads){
+        pthread_cond_wait(&(pool->exit_cond), &(pool->lock));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    main_event_loop->remove_reader(main_event_loop, pool->eventfd, pool);
+    close(pool->eventfd);
+    pool->eventfd = -1;
+}
+
+/*
+ * The task lives on the stack of the calling coroutine and the worker
+ * writes into it, so the wait can not be cut short by co_cancel() or a
+ * deadline: the coroutine stays parked until the worker is done.
+ */
+void *co_run_blocking(void *(*fn)(void *arg), void *arg){
+    struct blocking_pool *pool = &blocking_pool;
+    struct blocking_task task;
+    pthread_t thread;
+    pthread_attr_t attr;
+    if(!co_in_coroutine()){
+        return fn(arg);
+    }
+    if(start_blocking_pool() < 0){
+        return fn(arg);
+    }
+    task.fn = fn;
+    task.arg = arg;
+    task.done = 0;
+    task.coroutine = cur_coroutine;
+    pthread_mutex_lock(&(pool->lock));
+    list_add_before(&(task.node), &(pool->tasks));
+    if(pool->idle_threads){
+        pthread_cond_signal(&(pool->cond));
+    } else if(pool->threads < pool->max_threads){
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, blocking_worker, pool) == 0){
+            pool->threads += 1;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if(!pool->threads){
+        list_del(&(task.node));
+        pthread_mutex_unlock(&(pool->lock));
+        return fn(arg);
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    while(!task.done){
+        yield_coroutine();
+    }
+    errno = task.err;
+    return task.result;
+}
+
+int co_set_blocking_threads(int max_threads){
+    if(max_threads <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&(blocking_pool.lock));
+    blocking_pool.max_threads = max_threads;
+    pthread_mutex_unlock(&(blocking_pool.lock));
+    return 0;
+}
+
+static void *blocking_pread(void *arg){
+    struct blocking_io *io = arg;
+    return (void *)pread(io->fd, io->buf, io->count, io->offset);
+}
+
+static void *blocking_pwrite(void *arg){
+    struct blocking_io *io = arg;
+    return (void *)pwrite(io->fd, io->buf, io->count, io->offset);
+}
+
+static void *blocking_fsync(void *arg){
+    struct blocking_io *io = arg;
+    return (void *)(intptr_t)fsync(io->fd);
+}
+
+ssize_t co_pread(int fd, void *buf, size_t count, off_t offset){
+    struct blocking_io io = {fd, buf, count, offset};
+    return (ssize_t)co_run_blocking(blocking_pread, &io);
+}
+
+ssize_t co_pwrite(int fd, const void *buf, size_t count, off_t offset){
+    struct blocking_io io = {fd, (void *)buf, count, offset};
+    return (ssize_t)co_run_blocking(blocking_pwrite, &io);
+}
+
+int co_fsync(int fd){
+    struct blocking_io io = {fd, NULL, 0, 0};
+    return (int)(intptr_t)co_run_blocking(blocking_fsync, &io);
+}
+
+/* The event loop frees the task together with its post node. */
+static void run_post_task(struct event_loop *ev, void *arg){
+    struct post_task *task = arg;
+    if(task->flags & CO_POST_CALLBACK){
+        task->fn(task->arg);
+    } else {
+        co_make(0, task->fn, task->arg);
+    }
+}
+
+/*
+ * Shutdown handshake with co_post(): once post_closing is seen no new
+ * post starts, and the ones already past the check are waited for, so
+ * the event loop can be freed under no other thread's feet.
+ */
+static void close_posts(){
+    __atomic_store_n(&post_closing, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&post_inflight, __ATOMIC_SEQ_CST)){
+        sched_yield();
+    }
+}
+
+/*
+ * The only entry point meant to be called from other threads. It touches
+ * nothing but the event loop's post stack, and only while counted in
+ * post_inflight.
+ */
+int co_post(void (*fn)(void *arg), void *arg, int flags){
+    struct event_loop *ev;
+    struct post_task *task;
+    int ret = -1;
+    if(flags & ~CO_POST_CALLBACK){
+        errno = EINVAL;
+        return -1;
+    }
+    task = malloc(sizeof(struct post_task));
+    if(!task){
+        return -1;
+    }
+    task->post_node.callback = run_post_task;
+    task->post_node.arg = task;
+    task->fn = fn;
+    task->arg = arg;
+    task->flags = flags;
+    __atomic_add_fetch(&post_inflight, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&post_closing, __ATOMIC_SEQ_CST) || !(ev = __atomic_load_n(&main_event_loop, __ATOMIC_ACQUIRE))){
+        errno = ESRCH;
+    } else {
+        ret = ev->post(ev, &(task->post_node));
+    }
+    __atomic_sub_fetch(&post_inflight, 1, __ATOMIC_SEQ_CST);
+    if(ret < 0){
+        free(task);
+    }
+    return ret;
+}
+
+struct co_connpool *co_connpool_create(int max_idle, int max_active, double idle_timeout){
+    assert(main_event_loop);
+    struct co_connpool *pool;
+    struct timespec ts;
+    double interval = idle_timeout < CONNPOOL_SWEEP_INTERVAL ? idle_timeout : CONNPOOL_SWEEP_INTERVAL;
+    if(max_idle < 0 || max_active < 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    pool = calloc(1, sizeof(struct co_connpool));
+    if(!pool){
+        return NULL;
+    }
+    INIT_LIST_HEAD(&(pool->lru));
+    pool->max_idle = max_idle;
+    pool->max_active = max_active;
+    pool->idle_timeout = idle_timeout;
+    if(idle_timeout > 0){
+        ts.tv_sec = (time_t)interval;
+        ts.tv_nsec = (long)((interval - ts.tv_sec) * 1000000000);
+        pool->sweep_timer_id = main_event_loop->add_timer(main_event_loop, &ts, connpool_sweep_callback, pool);
+        if(pool->sweep_timer_id < 0){
+            free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+static struct connpool_dest *connpool_dest(struct co_connpool *pool, const struct sockaddr *addr, socklen_t addrlen){
+    struct connpool_dest *dest;
+    struct hlist_node *cur;
+    struct hlist_head *head;
+    const unsigned char *p = (const unsigned char *)addr;
+    uint32_t hash = 5381;
+    socklen_t i;
+    if(addrlen > sizeof(struct sockaddr_storage)){
+        errno = EINVAL;
+        return NULL;
+    }
+    for(i = 0; i < addrlen; i++){
+        hash = hash * 33 + p[i];
+    }
+    head = &(pool->dests[hash % CONNPOOL_HASH_SIZE]);
+    hlist_for_each_entry(dest, cur, head, node){
+        if(dest->addrlen == addrlen && !memcmp(&(dest->addr), addr, addrlen)){
+            return dest;
+        }
+    }
+    dest = calloc(1, sizeof(struct connpool_dest));
+    if(!dest){
+        return NULL;
+    }
+    memcpy(&(dest->addr), addr, addrlen);
+    dest->addrlen = addrlen;
+    INIT_LIST_HEAD(&(dest->idle));
+    INIT_LIST_HEAD(&(dest->waiters));
+    hlist_add_head(&(dest->node), head);
+    return dest;
+}
+
+static struct connpool_conn *connpool_conn(struct co_connpool *pool, int fd){
+    struct connpool_conn *conn;
+    struct hlist_node *cur;
+    hlist_for_each_entry(conn, cur, &(pool->conns[fd % CONNPOOL_HASH_SIZE]), node){
+        if(conn->fd == fd){
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/* Close an idle connection and forget it. */
+static void connpool_close(struct connpool_conn *conn){
+    main_event_loop->remove_reader(main_event_loop, conn->fd, conn);
+    list_del(&(conn->idle_node));
+    list_del(&(conn->lru_node));
+    hlist_del(&(conn->node));
+    close(conn->fd);
+    conn->pool->stats.idle -= 1;
+    free(conn);
+}
+
+/*
+ * Nothing is expected on an idle connection: readiness means the peer
+ * closed or reset it, or sent something nobody asked for.
+ */
+static void connpool_idle_callback(struct event_loop *ev, int fd, int event_type, void *arg){
+    struct connpool_conn *conn = arg;
+    conn->pool->stats.dead += 1;
+    connpool_close(conn);
+}
+
+static int connpool_sweep_callback(struct event_loop *ev, int64_t timer_id, void *arg){
+    struct co_connpool *pool = arg;
+    struct connpool_conn *conn;
+    double now = co_time();
+    while(!list_empty(&(pool->lru))){
+        conn = list_entry(pool->lru.prev, struct connpool_conn, lru_node);
+        if(now - conn->idle_since < pool->idle_timeout){
+            break;
+        }
+        connpool_close(conn);
+    }
+    return 1;
+}
+
+/*
+ * Check out a connection to addr: the most recently used idle one, or a
+ * new one. With max_active set, callers beyond it wait for a put.
+ */
+int co_connpool_get(struct co_connpool *pool, const struct sockaddr *addr, socklen_t addrlen, double timeout){
+    assert(main_event_loop);
+    struct connpool_dest *dest = connpool_dest(pool, addr, addrlen);
+    struct connpool_conn *conn;
+    double deadline = timeout > 0 ? co_time() + timeout : 0;
+    int fd, saved_errno;
+    if(!dest){
+        return -1;
+    }
+    while(pool->max_active && dest->active >= pool->max_active){
+        if(deadline > 0 && (timeout = deadline - co_time()) <= 0){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(wait_on(&(dest->waiters), timeout, 1) < 0){
+            return -1;
+        }
+    }
+    dest->active += 1;
+    if(!list_empty(&(dest->idle))){
+        conn = list_entry(dest->idle.next, struct connpool_conn, idle_node);
+        main_event_loop->remove_reader(main_event_loop, conn->fd, conn);
+        list_del(&(conn->idle_node));
+        list_del(&(conn->lru_node));
+        conn->idle = 0;
+        pool->stats.idle -= 1;
+        pool->stats.active += 1;
+        pool->stats.reuses += 1;
+        return conn->fd;
+    }
+    /* The wait for a slot may have used up the deadline; a connect timeout below 0 would never expire. */
+    if(deadline > 0 && (timeout = deadline - co_time()) <= 0){
+        conn = NULL;
+        fd = -1;
+        errno = ETIMEDOUT;
+    } else {
+        conn = calloc(1, sizeof(struct connpool_conn));
+        fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if(!conn || fd < 0 || co_connect_timeout(fd, addr, addrlen, deadline > 0 ? timeout : -1) < 0){
+        saved_errno = errno;
+        free(conn);
+        if(fd >= 0){
+            close(fd);
+        }
+        dest->active -= 1;
+        if(!list_empty(&(dest->waiters))){
+            wake_waiter(&(dest->waiters));
+        }
+        errno = saved_errno;
+        return -1;
+    }
+    conn->pool = pool;
+    conn->dest = dest;
+    conn->fd = fd;
+    hlist_add_head(&(conn->node), &(pool->conns[fd % CONNPOOL_HASH_SIZE]));
+    pool->stats.active += 1;
+    pool->stats.connects += 1;
+    return fd;
+}
+
+/*
+ * Give back a connection from co_connpool_get(). A reusable one goes idle,
+ * pushing out the least recently used idle connection when the pool holds
+ * max_idle already; any other is closed.
+ */
+int co_connpool_put(struct co_connpool *pool, int fd, int reusable){
+    struct connpool_conn *conn = fd >= 0 ? connpool_conn(pool, fd) : NULL;
+    struct connpool_dest *dest;
+    if(!conn || conn->idle){
+        errno = EBADF;
+        return -1;
+    }
+    dest = conn->dest;
+    dest->active -= 1;
+    pool->stats.active -= 1;
+    if(!list_empty(&(dest->waiters))){
+        wake_waiter(&(dest->waiters));
+    }
+    if(reusable && pool->max_idle && pool->stats.idle >= (uint64_t)pool->max_idle){
+        connpool_close(list_entry(pool->lru.prev, struct connpool_conn, lru_node));
+    }
+    if(!reusable || !pool->max_idle || main_event_loop->add_reader(main_event_loop, fd, connpool_idle_callback, conn) < 0){
+        hlist_del(&(conn->node));
+        close(fd);
+        free(conn);
+        return 0;
+    }
+    conn->idle = 1;
+    conn->idle_since = co_time();
+    list_add_after(&(conn->idle_node), &(dest->idle));
+    list_add_after(&(conn->lru_node), &(pool->lru));
+    pool->stats.idle += 1;
+    return 0;
+}
+
+int co_connpool_get_stats(struct co_connpool *pool, struct co_connpool_stats *stats){
+    *stats = pool->stats;
+    return 0;
+}
+
+int co_connpool_destroy(struct co_connpool *pool){
+    int i;
+    struct hlist_node *cur, *next;
+    struct connpool_dest *dest;
+    if(pool->stats.active){
+        errno = EBUSY;
+        return -1;
+    }
+    while(!list_empty(&(pool->lru))){
+        connpool_close(list_entry(pool->lru.next, struct connpool_conn, lru_node));
+    }
+    for(i = 0; i < CONNPOOL_HASH_SIZE; i++){
+        hlist_for_each_entry_safe(dest, cur, next, &(pool->dests[i]), node){
+            free(dest);
+        }
+    }
+    if(pool->sweep_timer_id > 0){
+        main_event_loop->remove_timer(main_event_loop, pool->sweep_timer_id);
+    }
+    free(pool);
+    return 0;
+}
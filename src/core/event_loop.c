@@ -1,8 +1,10 @@
 #define _GNU_SOURCE
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <sys/timerfd.h>
 #include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <signal.h>
 #include <string.h>
 #include <time.h>
@@ -11,9 +13,11 @@
 #include <stdint.h>
 #include "event_loop.h"
 #include "hlist.h"
+#include "mem_placement.h"
 
 static void event_loop_init(struct event_loop *ev);
 static void event_loop_destruct(struct event_loop *ev);
+static void release_event_loop(struct event_loop *ev);
 static int event_loop_accept(struct event_loop *ev, int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 static int event_loop_accept4(struct event_loop *ev, int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 static ssize_t event_loop_read(struct event_loop *ev, int fd, void *buf, size_t count);
@@ -27,18 +31,25 @@ static ssize_t event_loop_sendmsg(struct event_loop *ev, int sockfd, const struc
 static int event_loop_poll(struct event_loop *ev, int timeout);
 static int event_loop_epoll_wait(struct event_loop *ev, int timeout);
 static int event_loop_add_reader(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-static void event_loop_remove_reader(struct event_loop *ev, int fd);
+static void event_loop_remove_reader(struct event_loop *ev, int fd, void *arg);
 static int event_loop_add_writer(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-static void event_loop_remove_writer(struct event_loop *ev, int fd);
+static void event_loop_remove_writer(struct event_loop *ev, int fd, void *arg);
 static int event_loop_add_reader_writer(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-static void event_loop_remove_reader_writer(struct event_loop *ev, int fd);
+static void event_loop_remove_reader_writer(struct event_loop *ev, int fd, void *arg);
 static int event_loop_add_signal(struct event_loop *ev, int signo, void(*callback)(struct event_loop *ev, int signo, void *arg), void *arg);
 static void event_loop_remove_signal(struct event_loop *ev, int signo);
 static int64_t event_loop_add_timer(struct event_loop *ev, struct timespec *timespec, int(*callback)(struct event_loop *ev, int64_t timer_id, void *arg), void *arg);
 static void event_loop_remove_timer(struct event_loop *ev, int64_t timer_id);
 static int event_loop_add_defer(struct event_loop *ev, int(*callback)(struct event_loop *ev, void *arg), void *arg);
+static void event_loop_wakeup(struct event_loop *ev);
+static int event_loop_post(struct event_loop *ev, struct event_loop_post_node *post_node);
+static int event_loop_run_posts(struct event_loop *ev);
+static void event_loop_postfd_callback(struct event_loop *ev, int fd, int event_type, void *arg);
 static int event_loop_add_event(struct event_loop *ev, int fd, int event_type, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
-static void event_loop_remove_event(struct event_loop *ev, int fd, int event_type);
+static void event_loop_remove_event(struct event_loop *ev, int fd, int event_type, void *arg);
+static int event_loop_add_waiter(struct event_loop *ev, struct list_head *waiters, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg);
+static int event_loop_remove_waiter(struct event_loop *ev, struct list_head *waiters, void *arg);
+static inline void event_loop_fd_callback(struct event_loop *ev, struct event_loop_fd_node *fd_node, int event_type);
 
 static int event_loop_timer_node_cmp(const void *arg1, const void *arg2) {
     const struct event_loop_timer_node *timer_node1 = arg1;
@@ -93,7 +104,7 @@ static void event_loop_timerfd_callback(struct event_loop *ev, int fd, int event
         } else {
             ev->timer_heap->delete_value(ev->timer_heap, timer_node->heap_value);
             hlist_del(&(timer_node->hlist_node));
-    	    free(timer_node);
+    	    slab_free(&(ev->timer_node_cache), timer_node);
         }
     }
     memset(&itimerspec, 0, sizeof(struct itimerspec));
@@ -119,14 +130,35 @@ static void event_loop_signalfd_callback(struct event_loop *ev, int fd, int even
 }
 
 struct event_loop *alloc_event_loop(){
+    return alloc_event_loop_placed(0);
+}
+
+/*
+ * The loop embeds the epoll event array and the hash buckets, which are
+ * touched on every poll, so with mem_flags it is mapped through
+ * mem_placement_map() instead of calloc().
+ */
+struct event_loop *alloc_event_loop_placed(int mem_flags){
     struct event_loop *ev; 
-    ev = calloc(1, sizeof(struct event_loop));
+    size_t map_size = sizeof(struct event_loop);
+    if(mem_flags){
+        ev = mem_placement_map(&map_size, 0, mem_flags);
+    } else {
+        ev = calloc(1, sizeof(struct event_loop));
+    }
     if(!ev){
         return NULL;
     }
+    if(mem_flags){
+        ev->map_size = map_size;
+    }
+    slab_cache_init(&(ev->fd_node_cache), sizeof(struct event_loop_fd_node), SLAB_DEFAULT_OBJECTS);
+    slab_cache_init(&(ev->fd_waiter_cache), sizeof(struct event_loop_fd_waiter), SLAB_DEFAULT_OBJECTS);
+    slab_cache_init(&(ev->timer_node_cache), sizeof(struct event_loop_timer_node), SLAB_DEFAULT_OBJECTS);
+    slab_cache_init(&(ev->defer_node_cache), sizeof(struct event_loop_defer_node), SLAB_DEFAULT_OBJECTS);
     ev->timer_heap = alloc_heap(event_loop_timer_node_cmp);
     if(!ev->timer_heap){
-        free(ev);
+        release_event_loop(ev);
         return NULL;
     }
     ev->init = event_loop_init;
@@ -153,6 +185,8 @@ struct event_loop *alloc_event_loop(){
     ev->add_timer = event_loop_add_timer;
     ev->remove_timer = event_loop_remove_timer;
     ev->add_defer = event_loop_add_defer;
+    ev->wakeup = event_loop_wakeup;
+    ev->post = event_loop_post;
     ev->init(ev);
     return ev;
 }
@@ -165,6 +199,7 @@ static void event_loop_init(struct event_loop *ev){
     ev->ready_loop_id = 1;
     ev->recursive_depth = 0;
     ev->defer_free = 0;
+    ev->wakeup_pending = 0;
     for(i = 0; i < EVENT_LOOP_FD_HASH_SIZE; i++){
         INIT_HLIST_HEAD(&ev->fd_hash[i]);
     }
@@ -183,6 +218,10 @@ static void event_loop_init(struct event_loop *ev){
     ev->add_reader(ev, ev->signalfd, event_loop_signalfd_callback, NULL);
     ev->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
     ev->add_reader(ev, ev->timerfd, event_loop_timerfd_callback, NULL);
+    ev->post_head = NULL;
+    ev->post_signaled = 0;
+    ev->postfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ev->add_reader(ev, ev->postfd, event_loop_postfd_callback, NULL);
 }
 
 void free_event_loop(struct event_loop *ev){
@@ -190,40 +229,37 @@ void free_event_loop(struct event_loop *ev){
         ev->defer_free = 1;
     } else  {
         ev->destruct(ev);
+        release_event_loop(ev);
+    }
+}
+
+static void release_event_loop(struct event_loop *ev){
+    if(ev->map_size){
+        munmap(ev, ev->map_size);
+    } else {
         free(ev);
     }
 }
 
 static void event_loop_destruct(struct event_loop *ev){
-    int i;
-    struct hlist_head *head;
-    struct hlist_node *cur, *next;
-    struct event_loop_fd_node *fd_node;
-    struct event_loop_timer_node *timer_node;
     struct event_loop_signal_node *cur_signal_node, *next_signal_node;
-    struct event_loop_defer_node *cur_defer_node, *next_defer_node;
     close(ev->epollfd);
     close(ev->signalfd);
     close(ev->timerfd);
-    for(i=0; i < EVENT_LOOP_FD_HASH_SIZE; i++){
-        head = &ev->fd_hash[i];
-        hlist_for_each_entry_safe(fd_node, cur, next, head, hlist_node){
-            free(fd_node);
-	}
-    }
-    for(i=0; i < EVENT_LOOP_TIMER_HASH_SIZE; i++){
-        head = &ev->timer_hash[i];
-        hlist_for_each_entry_safe(timer_node, cur, next, head, hlist_node){
-            free(timer_node);
-	}
+    close(ev->postfd);
+    while(ev->post_head){
+        struct event_loop_post_node *post_node = ev->post_head;
+        ev->post_head = post_node->next;
+        free(post_node);
     }
     free_heap(ev->timer_heap);
     list_for_each_entry_safe(cur_signal_node, next_signal_node, &(ev->signal_head), list_node) {
         free(cur_signal_node);
     }
-    list_for_each_entry_safe(cur_defer_node, next_defer_node, &(ev->defer_head), list_node) {
-        free(cur_defer_node);
-    }
+    slab_cache_destroy(&(ev->fd_node_cache));
+    slab_cache_destroy(&(ev->fd_waiter_cache));
+    slab_cache_destroy(&(ev->timer_node_cache));
+    slab_cache_destroy(&(ev->defer_node_cache));
 }
 
 static int event_loop_add_event(struct event_loop *ev, int fd, int event_type, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg){
@@ -235,13 +271,14 @@ static int event_loop_add_event(struct event_loop *ev, int fd, int event_type, v
     event_type = event_type & (EVENT_LOOP_FD_READ | EVENT_LOOP_FD_WRITE);
     hlist_for_each_entry_safe(fd_node, cur, next, head, hlist_node){
         if(fd_node->fd == fd){
-            if(event_type & EVENT_LOOP_FD_READ){
-	        fd_node->reader_callback = callback;
-	        fd_node->reader_arg = arg;
-            } 
-	    if(event_type & EVENT_LOOP_FD_WRITE){
-	        fd_node->writer_callback = callback;
-	        fd_node->writer_arg = arg;
+            if((event_type & EVENT_LOOP_FD_READ) && event_loop_add_waiter(ev, &(fd_node->readers), callback, arg) < 0){
+                return -1;
+            }
+	    if((event_type & EVENT_LOOP_FD_WRITE) && event_loop_add_waiter(ev, &(fd_node->writers), callback, arg) < 0){
+                if(event_type & EVENT_LOOP_FD_READ){
+                    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_READ, arg);
+                }
+                return -1;
             }
 	    if(fd_node->event_type != (fd_node->event_type | event_type)){
 	        fd_node->event_type |= event_type;
@@ -264,33 +301,84 @@ static int event_loop_add_event(struct event_loop *ev, int fd, int event_type, v
 	    return 0;
 	}
     }
-    fd_node = calloc(1, sizeof(struct event_loop_fd_node));
+    fd_node = slab_alloc(&(ev->fd_node_cache));
     if(!fd_node){
         return -1;
     }
     fd_node->fd = fd;
+    INIT_LIST_HEAD(&(fd_node->readers));
+    INIT_LIST_HEAD(&(fd_node->writers));
     if(event_type & EVENT_LOOP_FD_READ){
         epoll_event.events |= EPOLLIN;
-        fd_node->reader_callback = callback;
-        fd_node->reader_arg = arg;
     }
     if(event_type & EVENT_LOOP_FD_WRITE){
         epoll_event.events |= EPOLLOUT;
-        fd_node->writer_callback = callback;
-        fd_node->writer_arg = arg;
     }
     epoll_event.events |= (EPOLLRDHUP | EPOLLET);
     epoll_event.data.fd = fd;
     fd_node->event_type = event_type;
-    int ret = epoll_ctl(ev->epollfd, EPOLL_CTL_ADD, fd, &epoll_event);
-    if(ret < 0){
-        free(fd_node);
+    if(((event_type & EVENT_LOOP_FD_READ) && event_loop_add_waiter(ev, &(fd_node->readers), callback, arg) < 0)
+        || ((event_type & EVENT_LOOP_FD_WRITE) && event_loop_add_waiter(ev, &(fd_node->writers), callback, arg) < 0)
+        || epoll_ctl(ev->epollfd, EPOLL_CTL_ADD, fd, &epoll_event) < 0){
+        event_loop_remove_waiter(ev, &(fd_node->readers), arg);
+        event_loop_remove_waiter(ev, &(fd_node->writers), arg);
+        slab_free(&(ev->fd_node_cache), fd_node);
         return -1;
     }
     hlist_add_head(&(fd_node->hlist_node), head);
     return 0;
 }
 
+/*
+ * Queue a waiter behind the others. Adding the same arg again only
+ * replaces its callback, so a caller re-arming an fd keeps its place.
+ */
+static int event_loop_add_waiter(struct event_loop *ev, struct list_head *waiters, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg){
+    struct event_loop_fd_waiter *waiter;
+    list_for_each_entry(waiter, waiters, node){
+        if(waiter->arg == arg){
+            waiter->callback = callback;
+            return 0;
+        }
+    }
+    waiter = slab_alloc(&(ev->fd_waiter_cache));
+    if(!waiter){
+        return -1;
+    }
+    waiter->callback = callback;
+    waiter->arg = arg;
+    list_add_before(&(waiter->node), waiters);
+    return 0;
+}
+
+/* Returns 1 when the list is left empty. */
+static int event_loop_remove_waiter(struct event_loop *ev, struct list_head *waiters, void *arg){
+    struct event_loop_fd_waiter *waiter;
+    list_for_each_entry(waiter, waiters, node){
+        if(waiter->arg == arg){
+            list_del(&(waiter->node));
+            slab_free(&(ev->fd_waiter_cache), waiter);
+            break;
+        }
+    }
+    return list_empty(waiters);
+}
+
+/*
+ * Wake one: only the first waiter hears of the edge. The fd stays on the
+ * ready list until a read or write meets EAGAIN, so whatever the first
+ * waiter leaves behind goes to the next one on a later pass.
+ */
+static inline void event_loop_fd_callback(struct event_loop *ev, struct event_loop_fd_node *fd_node, int event_type){
+    struct list_head *waiters = (event_type == EVENT_LOOP_FD_READ) ? &(fd_node->readers) : &(fd_node->writers);
+    struct event_loop_fd_waiter *waiter;
+    if(list_empty(waiters)){
+        return;
+    }
+    waiter = list_entry(waiters->next, struct event_loop_fd_waiter, node);
+    waiter->callback(ev, fd_node->fd, event_type, waiter->arg);
+}
+
 static int event_loop_add_reader(struct event_loop *ev, int fd, void(*callback)(struct event_loop *ev, int fd, int event_type, void *arg), void *arg){
     return event_loop_add_event(ev, fd, EVENT_LOOP_FD_READ, callback, arg);
 }
@@ -303,22 +391,25 @@ static int event_loop_add_reader_writer(struct event_loop *ev, int fd, void(*cal
     return event_loop_add_event(ev, fd, EVENT_LOOP_FD_READ | EVENT_LOOP_FD_WRITE, callback, arg);
 }
 
-static void event_loop_remove_event(struct event_loop *ev, int fd, int event_type){
+static void event_loop_remove_event(struct event_loop *ev, int fd, int event_type, void *arg){
     struct epoll_event epoll_event;
     struct event_loop_fd_node *fd_node;
     struct hlist_node *cur, *next;
     struct hlist_head *head = &(ev->fd_hash[EVENT_LOOP_FD_HASH(fd)]);
+    int emptied = 0;
     event_type = event_type & (EVENT_LOOP_FD_READ | EVENT_LOOP_FD_WRITE);
     hlist_for_each_entry_safe(fd_node, cur, next, head, hlist_node){
         if(fd_node->fd == fd){
+            /* The fd only stops watching a direction once its last waiter is gone. */
+            if((event_type & EVENT_LOOP_FD_READ) && event_loop_remove_waiter(ev, &(fd_node->readers), arg)){
+                emptied |= EVENT_LOOP_FD_READ;
+            }
+            if((event_type & EVENT_LOOP_FD_WRITE) && event_loop_remove_waiter(ev, &(fd_node->writers), arg)){
+                emptied |= EVENT_LOOP_FD_WRITE;
+            }
+            event_type = emptied;
 	    if(fd_node->event_type != (fd_node->event_type & (~event_type))){
 	        fd_node->event_type &= (~event_type);
-	        if(event_type & EVENT_LOOP_FD_READ){
-	            fd_node->reader_callback = fd_node->reader_arg = NULL;
-		}
-	        if(event_type & EVENT_LOOP_FD_WRITE){
-	            fd_node->writer_callback = fd_node->writer_arg = NULL;
-		}
 		if(!fd_node->event_type){
                     epoll_ctl(ev->epollfd, EPOLL_CTL_DEL, fd, NULL);
                     hlist_del(&(fd_node->hlist_node));
@@ -326,7 +417,7 @@ static void event_loop_remove_event(struct event_loop *ev, int fd, int event_typ
                         hlist_del(&(fd_node->hlist_ready_node));
                         list_del(&(fd_node->list_ready_node));
                     }
-	            free(fd_node);
+	            slab_free(&(ev->fd_node_cache), fd_node);
 		} else {
                     memset(&epoll_event, 0, sizeof(epoll_event));
                     if(fd_node->event_type & EVENT_LOOP_FD_READ){
@@ -351,23 +442,23 @@ static void event_loop_remove_event(struct event_loop *ev, int fd, int event_typ
     }
 }
 
-static void event_loop_remove_reader(struct event_loop *ev, int fd){
-    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_READ);
+static void event_loop_remove_reader(struct event_loop *ev, int fd, void *arg){
+    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_READ, arg);
 }
 
-static void event_loop_remove_writer(struct event_loop *ev, int fd){
-    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_WRITE);
+static void event_loop_remove_writer(struct event_loop *ev, int fd, void *arg){
+    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_WRITE, arg);
 }
 
-static void event_loop_remove_reader_writer(struct event_loop *ev, int fd){
-    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_READ | EVENT_LOOP_FD_WRITE);
+static void event_loop_remove_reader_writer(struct event_loop *ev, int fd, void *arg){
+    event_loop_remove_event(ev, fd, EVENT_LOOP_FD_READ | EVENT_LOOP_FD_WRITE, arg);
 }
 
 static int64_t event_loop_add_timer(struct event_loop *ev, struct timespec *timespec, int(*callback)(struct event_loop *ev, int64_t timer_id, void *arg), void *arg){
     struct timespec tmp_ts; 
     struct event_loop_timer_node *value1, *value2, *timer_node;
     struct itimerspec itimerspec;
-    timer_node = calloc(1, sizeof(struct event_loop_timer_node));
+    timer_node = slab_alloc(&(ev->timer_node_cache));
     if(!timer_node){
         return -1;
     }
@@ -386,7 +477,7 @@ static int64_t event_loop_add_timer(struct event_loop *ev, struct timespec *time
     value1 = ev->timer_heap->peek_value(ev->timer_heap); 
     timer_node->heap_value = ev->timer_heap->insert_value(ev->timer_heap, timer_node);
     if(!timer_node->heap_value){
-        free(timer_node);
+        slab_free(&(ev->timer_node_cache), timer_node);
         return -1;
     }
     value2 = ev->timer_heap->peek_value(ev->timer_heap); 
@@ -418,7 +509,7 @@ static void event_loop_remove_timer(struct event_loop *ev, int64_t timer_id) {
                 timerfd_settime(ev->timerfd, TFD_TIMER_ABSTIME, &itimerspec, NULL);
             }
             hlist_del(&(timer_node->hlist_node));
-	    free(timer_node);
+	    slab_free(&(ev->timer_node_cache), timer_node);
 	    return;
 	}
     }
@@ -468,7 +559,7 @@ static void event_loop_remove_signal(struct event_loop *ev, int signo){
 }
 
 static int event_loop_add_defer(struct event_loop *ev, int(*callback)(struct event_loop *ev, void *arg), void *arg){
-    struct event_loop_defer_node *defer_node = calloc(1, sizeof(struct event_loop_defer_node));
+    struct event_loop_defer_node *defer_node = slab_alloc(&(ev->defer_node_cache));
     if(!defer_node){
         return -1;
     }
@@ -478,12 +569,70 @@ static int event_loop_add_defer(struct event_loop *ev, int(*callback)(struct eve
     return 0;
 }
 
+/*
+ * Work made runnable by a callback must not wait for the next event, so
+ * the poll in progress stops redispatching ready fds and skips blocking
+ * once wakeup() has been called. Fds left ready are served next poll.
+ */
+static void event_loop_wakeup(struct event_loop *ev){
+    ev->wakeup_pending = 1;
+}
+
+/*
+ * Safe to call from any thread. Only the post which finds post_signaled
+ * clear writes the eventfd, so a burst of posts costs one wakeup; the
+ * loop clears the flag before it takes the stack.
+ */
+static int event_loop_post(struct event_loop *ev, struct event_loop_post_node *post_node){
+    uint64_t one = 1;
+    post_node->next = __atomic_load_n(&(ev->post_head), __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&(ev->post_head), &(post_node->next), post_node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    }
+    if(!__atomic_exchange_n(&(ev->post_signaled), 1, __ATOMIC_ACQ_REL)){
+        write(ev->postfd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+static int event_loop_run_posts(struct event_loop *ev){
+    int count = 0;
+    struct event_loop_post_node *post_node, *next, *fifo = NULL;
+    if(!__atomic_load_n(&(ev->post_head), __ATOMIC_RELAXED)){
+        return 0;
+    }
+    __atomic_store_n(&(ev->post_signaled), 0, __ATOMIC_SEQ_CST);
+    post_node = __atomic_exchange_n(&(ev->post_head), NULL, __ATOMIC_ACQUIRE);
+    while(post_node){
+        next = post_node->next;
+        post_node->next = fifo;
+        fifo = post_node;
+        post_node = next;
+    }
+    while(fifo){
+        post_node = fifo;
+        fifo = post_node->next;
+        post_node->callback(ev, post_node->arg);
+        free(post_node);
+        count++;
+    }
+    return count;
+}
+
+static void event_loop_postfd_callback(struct event_loop *ev, int fd, int event_type, void *arg){
+    uint64_t count;
+    while(ev->read(ev, fd, &count, sizeof(count)) > 0){
+    }
+    event_loop_run_posts(ev);
+}
+
 static int event_loop_poll(struct event_loop *ev, int timeout){
     int nfds, epoll_wait_ret, run_callback_count = 0;
     uint64_t ready_loop_id;
     struct event_loop_fd_node *fd_node;
     struct event_loop_defer_node *cur_defer, *next_defer;
     ev->recursive_depth += 1;
+    ev->wakeup_pending = 0;
+    run_callback_count += event_loop_run_posts(ev);
     if(!list_empty(&(ev->ready_fd_head)) && (ev->recursive_depth & 1)){
         epoll_wait_ret = event_loop_epoll_wait(ev, 0);
         if(epoll_wait_ret < 0){
@@ -492,7 +641,7 @@ static int event_loop_poll(struct event_loop *ev, int timeout){
         run_callback_count += epoll_wait_ret;
     }
     ready_loop_id = ev->ready_loop_id++;
-    while(!list_empty(&(ev->ready_fd_head))){
+    while(!list_empty(&(ev->ready_fd_head)) && !ev->wakeup_pending){
         fd_node = list_entry(ev->ready_fd_head.next, typeof(*fd_node), list_ready_node);
 	if(fd_node->ready_loop_id == ready_loop_id){
             epoll_wait_ret = event_loop_epoll_wait(ev, 0);
@@ -509,30 +658,30 @@ static int event_loop_poll(struct event_loop *ev, int timeout){
 	if(!fd_node->last_ready_flag){
 	    fd_node->last_ready_flag = 1;
 	    if(fd_node->ready_event_type & EVENT_LOOP_FD_READ){
-                fd_node->reader_callback(ev, fd_node->fd, EVENT_LOOP_FD_READ, fd_node->reader_arg);
+                event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_READ);
                 run_callback_count++;
 	        continue;
 	    }
 	    if(fd_node->ready_event_type & EVENT_LOOP_FD_WRITE){
-                fd_node->writer_callback(ev, fd_node->fd, EVENT_LOOP_FD_WRITE, fd_node->writer_arg);
+                event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_WRITE);
                 run_callback_count++;
 		continue;
 	    }
 	} else {  
 	    fd_node->last_ready_flag = 0;
 	    if(fd_node->ready_event_type & EVENT_LOOP_FD_WRITE){
-                fd_node->writer_callback(ev, fd_node->fd, EVENT_LOOP_FD_WRITE, fd_node->writer_arg);
+                event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_WRITE);
                 run_callback_count++;
 		continue;
 	    }
 	    if(fd_node->ready_event_type & EVENT_LOOP_FD_READ){
-                fd_node->reader_callback(ev, fd_node->fd, EVENT_LOOP_FD_READ, fd_node->reader_arg);
+                event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_READ);
                 run_callback_count++;
 	        continue;
 	    }
 	}
     }
-    if(!list_empty(&(ev->defer_head))){
+    if(!list_empty(&(ev->defer_head)) || ev->wakeup_pending){
         epoll_wait_ret = event_loop_epoll_wait(ev, 0);
     } else {
         epoll_wait_ret = event_loop_epoll_wait(ev, timeout);
@@ -546,7 +695,7 @@ static int event_loop_poll(struct event_loop *ev, int timeout){
 	list_del(&cur_defer->list_node);
         run_callback_count++;
         if(!cur_defer->callback(ev, cur_defer->arg)){
-            free(cur_defer);
+            slab_free(&(ev->defer_node_cache), cur_defer);
 	} else {
             list_add_before(&(cur_defer->list_node), &(ev->defer_head));
 	}
@@ -590,7 +739,7 @@ static int event_loop_epoll_wait(struct event_loop *ev, int timeout){
                         hlist_add_head(&(fd_node->hlist_ready_node), &(ev->ready_fd_hash[EVENT_LOOP_READY_FD_HASH(fd)]));
                         list_add_before(&(fd_node->list_ready_node), &(ev->ready_fd_head));
     	            }
-                    fd_node->reader_callback(ev, fd, EVENT_LOOP_FD_READ, fd_node->reader_arg);
+                    event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_READ);
 		    run_callback_count++;
                     if(event_type){
                         goto loop_fd;
@@ -605,7 +754,7 @@ static int event_loop_epoll_wait(struct event_loop *ev, int timeout){
                         hlist_add_head(&(fd_node->hlist_ready_node), &(ev->ready_fd_hash[EVENT_LOOP_READY_FD_HASH(fd)]));
                         list_add_before(&(fd_node->list_ready_node), &(ev->ready_fd_head));
     	            }
-                    fd_node->writer_callback(ev, fd, EVENT_LOOP_FD_WRITE, fd_node->writer_arg);
+                    event_loop_fd_callback(ev, fd_node, EVENT_LOOP_FD_WRITE);
 		    run_callback_count++;
                     if(event_type){
                         goto loop_fd;
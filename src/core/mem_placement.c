@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include "mem_placement.h"
+
+#define MEM_PLACEMENT_MPOL_PREFERRED 1
+#define MEM_PLACEMENT_MAX_NODES 1024
+
+void *mem_placement_map(size_t *size, size_t guard, int flags);
+static void *mem_placement_map_aligned(size_t body, size_t guard, int flags);
+static void mem_placement_bind_local(void *addr, size_t len);
+static void mem_placement_populate(void *addr, size_t len);
+
+static inline size_t mem_placement_align(size_t size, size_t align){
+    return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Hugepages only back ranges aligned to the hugepage size, so the body
+ * is placed on such a boundary inside a larger PROT_NONE reservation,
+ * with the guard (if any) directly below it and the rest trimmed away.
+ */
+static void *mem_placement_map_aligned(size_t body, size_t guard, int flags){
+    size_t total = guard + body + MEM_PLACEMENT_HUGE_PAGE_SIZE;
+    char *base, *start, *mem;
+    base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED){
+        return MAP_FAILED;
+    }
+    start = (char *)mem_placement_align((uintptr_t)base + guard, MEM_PLACEMENT_HUGE_PAGE_SIZE);
+    if(start - guard > base){
+        munmap(base, start - guard - base);
+    }
+    if(start + body < base + total){
+        munmap(start + body, base + total - start - body);
+    }
+    mem = MAP_FAILED;
+    if(flags & MEM_PLACEMENT_HUGETLB){
+        mem = mmap(start, body, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+    }
+    if(mem == MAP_FAILED){
+        mem = mmap(start, body, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if(mem == MAP_FAILED){
+            munmap(start - guard, guard + body);
+            return MAP_FAILED;
+        }
+        madvise(mem, body, MADV_HUGEPAGE);
+    }
+    return start - guard;
+}
+
+static void mem_placement_bind_local(void *addr, size_t len){
+    unsigned int cpu, node;
+    unsigned long mask[MEM_PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= MEM_PLACEMENT_MAX_NODES){
+        return;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, addr, len, MEM_PLACEMENT_MPOL_PREFERRED, mask, MEM_PLACEMENT_MAX_NODES, 0);
+}
+
+static void mem_placement_populate(void *addr, size_t len){
+    size_t i;
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    for(i = 0; i < len; i += page_size){
+        ((volatile char *)addr)[i] = 0;
+    }
+}
+
+/*
+ * Map *size bytes, the first guard bytes of which are PROT_NONE, with the
+ * placement asked for in flags. *size is rounded up to what was actually
+ * mapped. Hugepages that are not available fall back to normal pages.
+ */
+void *mem_placement_map(size_t *size, size_t guard, int flags){
+    size_t body = *size - guard;
+    char *mem;
+    if(flags & (MEM_PLACEMENT_HUGEPAGE | MEM_PLACEMENT_HUGETLB)){
+        body = mem_placement_align(body, MEM_PLACEMENT_HUGE_PAGE_SIZE);
+        mem = mem_placement_map_aligned(body, guard, flags);
+    } else {
+        mem = mmap(NULL, guard + body, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | (flags & MEM_PLACEMENT_POPULATE && !(flags & MEM_PLACEMENT_NUMA_LOCAL) ? MAP_POPULATE : 0), -1, 0);
+        if(mem != MAP_FAILED && guard){
+            mprotect(mem, guard, PROT_NONE);
+        }
+    }
+    if(mem == MAP_FAILED){
+        return NULL;
+    }
+    if(flags & MEM_PLACEMENT_NUMA_LOCAL){
+        mem_placement_bind_local(mem + guard, body);
+    }
+    if(flags & MEM_PLACEMENT_POPULATE && (flags & (MEM_PLACEMENT_HUGEPAGE | MEM_PLACEMENT_HUGETLB | MEM_PLACEMENT_NUMA_LOCAL))){
+        mem_placement_populate(mem + guard, body);
+    }
+    *size = guard + body;
+    return mem;
+}
@@ -0,0 +1,981 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <limits.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+#include "hlist.h"
+
+#define DNS_PORT 53
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
+#define DNS_MAX_NAME 256
+#define DNS_MAX_ADDRS 16
+#define DNS_UDP_SIZE 512
+#define DNS_TCP_SIZE 65536
+#define DNS_HEADER_SIZE 12
+#define DNS_CACHE_HASH_SIZE 256
+#define DNS_CACHE_MAX 4096
+#define DNS_MAX_TTL 86400
+#define DNS_MAX_NEGATIVE_TTL 3600
+#define DNS_CONF_CHECK_INTERVAL 1.0
+#define DNS_DEFAULT_TIMEOUT 5
+#define DNS_DEFAULT_ATTEMPTS 2
+#define DNS_LOOKUP_STACK_SIZE (64 * 1024)
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_HOSTS "/etc/hosts"
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_STATE_PENDING 0
+#define DNS_STATE_DONE 1
+
+#define DNS_STATUS_OK 0
+#define DNS_STATUS_NONAME 1
+#define DNS_STATUS_FAIL 2
+#define DNS_STATUS_TRUNCATED 3
+
+struct dns_addr {
+    int family;
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } addr;
+};
+
+/*
+ * One cache entry per (name, query type). An entry is PENDING while one
+ * coroutine queries the servers; other lookups of the same name wait on
+ * dns_cond instead of sending their own query.
+ */
+struct dns_entry {
+    struct hlist_node node;
+    char name[DNS_MAX_NAME];
+    int qtype;
+    int state;
+    int status;
+    double expires;
+    int naddrs;
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+    char canonname[DNS_MAX_NAME];
+    int waiters;
+};
+
+struct dns_host {
+    char name[DNS_MAX_NAME];
+    struct dns_addr addr;
+};
+
+struct dns_config {
+    char resolv_conf_path[PATH_MAX];
+    char hosts_path[PATH_MAX];
+    struct sockaddr_storage servers[DNS_MAX_SERVERS];
+    socklen_t server_lens[DNS_MAX_SERVERS];
+    int nservers;
+    char search[DNS_MAX_SEARCH][DNS_MAX_NAME];
+    int nsearch;
+    int ndots;
+    int timeout;
+    int attempts;
+    time_t resolv_conf_mtime;
+    time_t hosts_mtime;
+    double checked_at;
+    struct dns_host *hosts;
+    int nhosts;
+};
+
+/*
+ * The result of one name for one address family, copied out of the cache
+ * so that the entry may be replaced while the caller builds its answer.
+ */
+struct dns_result {
+    int status;
+    int naddrs;
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+    char canonname[DNS_MAX_NAME];
+};
+
+/*
+ * Shared by co_getaddrinfo() and the coroutine it starts to query the
+ * second address family; whichever lets go last frees it.
+ */
+struct dns_job {
+    int refs;
+    char name[DNS_MAX_NAME];
+    int qtype;
+    struct dns_result result;
+};
+
+struct dns_config dns_config = {
+    .resolv_conf_path = DNS_RESOLV_CONF,
+    .hosts_path = DNS_HOSTS,
+    .checked_at = -DNS_CONF_CHECK_INTERVAL,
+};
+struct hlist_head dns_cache[DNS_CACHE_HASH_SIZE];
+int dns_cache_count = 0;
+struct co_mutex *dns_mutex = NULL;
+struct co_cond *dns_cond = NULL;
+uint16_t dns_random_pool[64];
+int dns_random_left = 0;
+
+int co_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+void co_freeaddrinfo(struct addrinfo *res);
+int co_set_resolv_conf(const char *resolv_conf, const char *hosts);
+static uint16_t dns_random_id();
+static uint32_t dns_name_hash(const char *name, int qtype);
+static void dns_load_config();
+static void dns_parse_resolv_conf(FILE *fp);
+static void dns_parse_hosts(FILE *fp);
+static int dns_hosts_lookup(const char *name, int family, struct dns_result *result);
+static struct dns_entry *dns_cache_find(const char *name, int qtype);
+static struct dns_entry *dns_cache_insert(const char *name, int qtype);
+static void dns_cache_flush();
+static int dns_encode_query(unsigned char *buf, uint16_t id, const char *name, int qtype);
+static int dns_expand_name(const unsigned char *msg, int len, int off, char *out, int outlen);
+static int dns_parse_response(const unsigned char *msg, int len, uint16_t id, int qtype, struct dns_entry *entry, double *ttl);
+static int dns_exchange_udp(struct sockaddr *server, socklen_t server_len, const unsigned char *query, int qlen, unsigned char *answer, double timeout);
+static int dns_exchange_tcp(struct sockaddr *server, socklen_t server_len, const unsigned char *query, int qlen, unsigned char *answer, double timeout);
+static void dns_query(struct dns_entry *entry);
+static void dns_resolve(const char *name, int qtype, struct dns_result *result);
+static void dns_lookup_routine(void *arg);
+static void dns_release_job(struct dns_job *job);
+static int dns_lookup_name(const char *name, int family, struct dns_result *v4, struct dns_result *v6);
+static int dns_service_port(const char *service, int socktype, int flags, int *port);
+static int dns_append(struct addrinfo ***tail, const struct dns_addr *addr, int port, int socktype, int protocol);
+
+/*
+ * The transaction id is half of what stands between us and a spoofed
+ * answer, so it comes from the kernel CSPRNG, a pool's worth per syscall.
+ */
+static uint16_t dns_random_id(){
+    ssize_t ret;
+    int fd;
+    if(!dns_random_left){
+        while((ret = getrandom(dns_random_pool, sizeof(dns_random_pool), 0)) < 0 && errno == EINTR){
+        }
+        if(ret != sizeof(dns_random_pool) && (fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) >= 0){
+            read(fd, dns_random_pool, sizeof(dns_random_pool));
+            close(fd);
+        }
+        dns_random_left = sizeof(dns_random_pool) / sizeof(dns_random_pool[0]);
+    }
+    return dns_random_pool[--dns_random_left];
+}
+
+static uint32_t dns_name_hash(const char *name, int qtype){
+    uint32_t hash = 5381 + qtype;
+    while(*name){
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+/*
+ * Both files are read again when their mtime changes, looked at no more
+ * than once per DNS_CONF_CHECK_INTERVAL.
+ */
+static void dns_load_config(){
+    struct stat st;
+    FILE *fp;
+    double now = co_time();
+    if(now - dns_config.checked_at < DNS_CONF_CHECK_INTERVAL){
+        return;
+    }
+    dns_config.checked_at = now;
+    if(stat(dns_config.resolv_conf_path, &st) < 0){
+        st.st_mtime = 0;
+    }
+    if(st.st_mtime != dns_config.resolv_conf_mtime || !dns_config.attempts){
+        dns_config.resolv_conf_mtime = st.st_mtime;
+        dns_config.nservers = 0;
+        dns_config.nsearch = 0;
+        dns_config.ndots = 1;
+        dns_config.timeout = DNS_DEFAULT_TIMEOUT;
+        dns_config.attempts = DNS_DEFAULT_ATTEMPTS;
+        if((fp = fopen(dns_config.resolv_conf_path, "re"))){
+            dns_parse_resolv_conf(fp);
+            fclose(fp);
+        }
+        if(!dns_config.nservers){
+            struct sockaddr_in *sin = (struct sockaddr_in *)&dns_config.servers[0];
+            memset(sin, 0, sizeof(struct sockaddr_storage));
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(DNS_PORT);
+            sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            dns_config.server_lens[0] = sizeof(struct sockaddr_in);
+            dns_config.nservers = 1;
+        }
+    }
+    if(stat(dns_config.hosts_path, &st) < 0){
+        st.st_mtime = 0;
+    }
+    if(st.st_mtime != dns_config.hosts_mtime || !dns_config.hosts){
+        dns_config.hosts_mtime = st.st_mtime;
+        free(dns_config.hosts);
+        dns_config.hosts = NULL;
+        dns_config.nhosts = 0;
+        if((fp = fopen(dns_config.hosts_path, "re"))){
+            dns_parse_hosts(fp);
+            fclose(fp);
+        }
+    }
+}
+
+static void dns_parse_resolv_conf(FILE *fp){
+    char line[512], *key, *value, *save;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    while(fgets(line, sizeof(line), fp)){
+        if(!(key = strtok_r(line, " \t\r\n", &save)) || *key == '#' || *key == ';'){
+            continue;
+        }
+        if(!strcmp(key, "nameserver") && (value = strtok_r(NULL, " \t\r\n", &save)) && dns_config.nservers < DNS_MAX_SERVERS){
+            memset(&dns_config.servers[dns_config.nservers], 0, sizeof(struct sockaddr_storage));
+            sin = (struct sockaddr_in *)&dns_config.servers[dns_config.nservers];
+            sin6 = (struct sockaddr_in6 *)&dns_config.servers[dns_config.nservers];
+            if(inet_pton(AF_INET, value, &sin->sin_addr) == 1){
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(DNS_PORT);
+                dns_config.server_lens[dns_config.nservers++] = sizeof(struct sockaddr_in);
+            } else if(inet_pton(AF_INET6, value, &sin6->sin6_addr) == 1){
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(DNS_PORT);
+                dns_config.server_lens[dns_config.nservers++] = sizeof(struct sockaddr_in6);
+            }
+        } else if(!strcmp(key, "search") || !strcmp(key, "domain")){
+            dns_config.nsearch = 0;
+            while((value = strtok_r(NULL, " \t\r\n", &save)) && dns_config.nsearch < DNS_MAX_SEARCH){
+                if(strlen(value) < DNS_MAX_NAME - 1){
+                    strcpy(dns_config.search[dns_config.nsearch++], value);
+                }
+            }
+        } else if(!strcmp(key, "options")){
+            while((value = strtok_r(NULL, " \t\r\n", &save))){
+                if(!strncmp(value, "ndots:", 6)){
+                    dns_config.ndots = atoi(value + 6);
+                } else if(!strncmp(value, "timeout:", 8) && atoi(value + 8) > 0){
+                    dns_config.timeout = atoi(value + 8);
+                } else if(!strncmp(value, "attempts:", 9) && atoi(value + 9) > 0){
+                    dns_config.attempts = atoi(value + 9);
+                }
+            }
+        }
+    }
+}
+
+static void dns_parse_hosts(FILE *fp){
+    char line[1024], *token, *save, *hash;
+    struct dns_addr addr;
+    struct dns_host *hosts;
+    int capacity = 0;
+    while(fgets(line, sizeof(line), fp)){
+        if((hash = strchr(line, '#'))){
+            *hash = '\0';
+        }
+        if(!(token = strtok_r(line, " \t\r\n", &save))){
+            continue;
+        }
+        if(inet_pton(AF_INET, token, &addr.addr.v4) == 1){
+            addr.family = AF_INET;
+        } else if(inet_pton(AF_INET6, token, &addr.addr.v6) == 1){
+            addr.family = AF_INET6;
+        } else {
+            continue;
+        }
+        while((token = strtok_r(NULL, " \t\r\n", &save))){
+            if(strlen(token) >= DNS_MAX_NAME){
+                continue;
+            }
+            if(dns_config.nhosts == capacity){
+                capacity = capacity ? capacity * 2 : 16;
+                hosts = realloc(dns_config.hosts, capacity * sizeof(struct dns_host));
+                if(!hosts){
+                    return;
+                }
+                dns_config.hosts = hosts;
+            }
+            strcpy(dns_config.hosts[dns_config.nhosts].name, token);
+            dns_config.hosts[dns_config.nhosts++].addr = addr;
+        }
+    }
+}
+
+static int dns_hosts_lookup(const char *name, int family, struct dns_result *result){
+    int i;
+    memset(result, 0, sizeof(struct dns_result));
+    result->status = DNS_STATUS_NONAME;
+    for(i = 0; i < dns_config.nhosts && result->naddrs < DNS_MAX_ADDRS; i++){
+        if(dns_config.hosts[i].addr.family == family && !strcasecmp(dns_config.hosts[i].name, name)){
+            result->addrs[result->naddrs++] = dns_config.hosts[i].addr;
+            result->status = DNS_STATUS_OK;
+        }
+    }
+    return result->naddrs;
+}
+
+static struct dns_entry *dns_cache_find(const char *name, int qtype){
+    struct hlist_node *cur;
+    struct dns_entry *entry;
+    hlist_for_each_entry(entry, cur, &dns_cache[dns_name_hash(name, qtype) & (DNS_CACHE_HASH_SIZE - 1)], node){
+        if(entry->qtype == qtype && !strcmp(entry->name, name)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct dns_entry *dns_cache_insert(const char *name, int qtype){
+    int i;
+    double now;
+    struct hlist_node *cur, *next;
+    struct dns_entry *entry, *oldest = NULL;
+    if(dns_cache_count >= DNS_CACHE_MAX){
+        now = co_time();
+        for(i = 0; i < DNS_CACHE_HASH_SIZE; i++){
+            hlist_for_each_entry_safe(entry, cur, next, &dns_cache[i], node){
+                if(entry->state != DNS_STATE_DONE || entry->waiters){
+                    continue;
+                }
+                if(entry->expires <= now){
+                    hlist_del(&(entry->node));
+                    free(entry);
+                    dns_cache_count -= 1;
+                } else if(!oldest || entry->expires < oldest->expires){
+                    oldest = entry;
+                }
+            }
+        }
+        if(dns_cache_count >= DNS_CACHE_MAX && oldest){
+            hlist_del(&(oldest->node));
+            free(oldest);
+            dns_cache_count -= 1;
+        }
+    }
+    entry = calloc(1, sizeof(struct dns_entry));
+    if(!entry){
+        return NULL;
+    }
+    strcpy(entry->name, name);
+    entry->qtype = qtype;
+    hlist_add_head(&(entry->node), &dns_cache[dns_name_hash(name, qtype) & (DNS_CACHE_HASH_SIZE - 1)]);
+    dns_cache_count += 1;
+    return entry;
+}
+
+static void dns_cache_flush(){
+    int i;
+    struct hlist_node *cur, *next;
+    struct dns_entry *entry;
+    for(i = 0; i < DNS_CACHE_HASH_SIZE; i++){
+        hlist_for_each_entry_safe(entry, cur, next, &dns_cache[i], node){
+            if(entry->state == DNS_STATE_DONE && !entry->waiters){
+                hlist_del(&(entry->node));
+                free(entry);
+                dns_cache_count -= 1;
+            } else {
+                entry->expires = 0;
+            }
+        }
+    }
+}
+
+static int dns_encode_query(unsigned char *buf, uint16_t id, const char *name, int qtype){
+    int off = DNS_HEADER_SIZE, len;
+    const char *label = name, *dot;
+    memset(buf, 0, DNS_HEADER_SIZE);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = DNS_FLAG_RD >> 8;
+    buf[5] = 1;
+    while(*label){
+        dot = strchr(label, '.');
+        len = dot ? dot - label : (int)strlen(label);
+        if(len == 0 || len > 63 || off + len + 1 > DNS_UDP_SIZE - 5){
+            return -1;
+        }
+        buf[off++] = len;
+        memcpy(buf + off, label, len);
+        off += len;
+        label += len + (dot ? 1 : 0);
+    }
+    buf[off++] = 0;
+    buf[off++] = qtype >> 8;
+    buf[off++] = qtype & 0xff;
+    buf[off++] = 0;
+    buf[off++] = DNS_CLASS_IN;
+    return off;
+}
+
+/*
+ * Decode the possibly compressed name at off into out, and return the
+ * offset just after it in the message. out may be NULL to skip a name.
+ */
+static int dns_expand_name(const unsigned char *msg, int len, int off, char *out, int outlen){
+    int end = -1, used = 0, jumps = 0, label;
+    while(off < len){
+        label = msg[off];
+        if((label & 0xc0) == 0xc0){
+            if(off + 1 >= len || ++jumps > 32){
+                return -1;
+            }
+            if(end < 0){
+                end = off + 2;
+            }
+            off = ((label & 0x3f) << 8) | msg[off + 1];
+            continue;
+        }
+        if(!label){
+            if(out){
+                out[used ? used - 1 : 0] = '\0';
+            }
+            return end < 0 ? off + 1 : end;
+        }
+        if(off + 1 + label > len){
+            return -1;
+        }
+        if(out){
+            if(used + label + 1 > outlen){
+                return -1;
+            }
+            memcpy(out + used, msg + off + 1, label);
+            used += label;
+            out[used++] = '.';
+        }
+        off += label + 1;
+    }
+    return -1;
+}
+
+static inline uint16_t dns_u16(const unsigned char *p){
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t dns_u32(const unsigned char *p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * Fill entry from an answer. The TTL is the smallest one of the records
+ * used; for NXDOMAIN and NODATA answers it comes from the SOA record of
+ * the authority section (RFC 2308), and without one nothing is cached.
+ */
+static int dns_parse_response(const unsigned char *msg, int len, uint16_t id, int qtype, struct dns_entry *entry, double *ttl){
+    int off = DNS_HEADER_SIZE, i, qdcount, ancount, nscount, rcode, type, class, rdlength;
+    uint16_t flags;
+    uint32_t rr_ttl, min_ttl = DNS_MAX_TTL, negative_ttl = 0;
+    if(len < DNS_HEADER_SIZE || dns_u16(msg) != id){
+        return -1;
+    }
+    flags = dns_u16(msg + 2);
+    if(!(flags & DNS_FLAG_QR)){
+        return -1;
+    }
+    if(flags & DNS_FLAG_TC){
+        return DNS_STATUS_TRUNCATED;
+    }
+    rcode = flags & 0xf;
+    qdcount = dns_u16(msg + 4);
+    ancount = dns_u16(msg + 6);
+    nscount = dns_u16(msg + 8);
+    for(i = 0; i < qdcount; i++){
+        if((off = dns_expand_name(msg, len, off, NULL, 0)) < 0 || off + 4 > len){
+            return -1;
+        }
+        if(dns_u16(msg + off) != qtype){
+            return -1;
+        }
+        off += 4;
+    }
+    entry->naddrs = 0;
+    strcpy(entry->canonname, entry->name);
+    for(i = 0; i < ancount + nscount; i++){
+        if((off = dns_expand_name(msg, len, off, NULL, 0)) < 0 || off + 10 > len){
+            return -1;
+        }
+        type = dns_u16(msg + off);
+        class = dns_u16(msg + off + 2);
+        rr_ttl = dns_u32(msg + off + 4);
+        rdlength = dns_u16(msg + off + 8);
+        off += 10;
+        if(off + rdlength > len){
+            return -1;
+        }
+        if(class == DNS_CLASS_IN && i < ancount){
+            if(type == qtype && entry->naddrs < DNS_MAX_ADDRS && ((type == DNS_TYPE_A && rdlength == 4) || (type == DNS_TYPE_AAAA && rdlength == 16))){
+                entry->addrs[entry->naddrs].family = type == DNS_TYPE_A ? AF_INET : AF_INET6;
+                memcpy(&(entry->addrs[entry->naddrs++].addr), msg + off, rdlength);
+                min_ttl = rr_ttl < min_ttl ? rr_ttl : min_ttl;
+            } else if(type == DNS_TYPE_CNAME){
+                if(dns_expand_name(msg, len, off, entry->canonname, DNS_MAX_NAME) < 0){
+                    return -1;
+                }
+                min_ttl = rr_ttl < min_ttl ? rr_ttl : min_ttl;
+            }
+        } else if(class == DNS_CLASS_IN && type == DNS_TYPE_SOA){
+            int soa = dns_expand_name(msg, len, off, NULL, 0);
+            if(soa < 0 || (soa = dns_expand_name(msg, len, soa, NULL, 0)) < 0 || soa + 20 > off + rdlength){
+                return -1;
+            }
+            negative_ttl = dns_u32(msg + soa + 16);
+            negative_ttl = rr_ttl < negative_ttl ? rr_ttl : negative_ttl;
+            negative_ttl = negative_ttl < DNS_MAX_NEGATIVE_TTL ? negative_ttl : DNS_MAX_NEGATIVE_TTL;
+        }
+        off += rdlength;
+    }
+    if(rcode == DNS_RCODE_NOERROR && entry->naddrs){
+        *ttl = min_ttl;
+        return DNS_STATUS_OK;
+    }
+    if(rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN){
+        entry->naddrs = 0;
+        *ttl = negative_ttl;
+        return DNS_STATUS_NONAME;
+    }
+    return DNS_STATUS_FAIL;
+}
+
+static int dns_exchange_udp(struct sockaddr *server, socklen_t server_len, const unsigned char *query, int qlen, unsigned char *answer, double timeout){
+    double deadline = co_time() + timeout, left;
+    ssize_t n = -1;
+    int fd = socket(server->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    /*
+     * A connected socket only receives from the server, and an ICMP port
+     * unreachable comes back as ECONNREFUSED.
+     */
+    if(connect(fd, server, server_len) < 0 || co_send(fd, query, qlen, 0, timeout) != qlen){
+        close(fd);
+        return -1;
+    }
+    while((left = deadline - co_time()) > 0){
+        n = co_recv(fd, answer, DNS_UDP_SIZE, 0, left);
+        if(n < 0 || (n >= 2 && !memcmp(answer, query, 2))){
+            break;
+        }
+        n = -1;
+    }
+    close(fd);
+    return n;
+}
+
+static int dns_exchange_tcp(struct sockaddr *server, socklen_t server_len, const unsigned char *query, int qlen, unsigned char *answer, double timeout){
+    double deadline = co_time() + timeout, left;
+    unsigned char prefix[2];
+    struct co_select_case select_case;
+    int fd, optval = 0, got = 0, want = -1;
+    socklen_t optlen = sizeof(optval);
+    ssize_t n;
+    fd = socket(server->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    if(connect(fd, server, server_len) < 0){
+        memset(&select_case, 0, sizeof(select_case));
+        select_case.type = CO_SELECT_WRITE;
+        select_case.fd = fd;
+        if(errno != EINPROGRESS || co_select(&select_case, 1, timeout) < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &optlen) < 0 || optval){
+            close(fd);
+            return -1;
+        }
+    }
+    prefix[0] = qlen >> 8;
+    prefix[1] = qlen & 0xff;
+    if(co_write(fd, prefix, 2, timeout) != 2 || co_write(fd, query, qlen, deadline - co_time()) != qlen){
+        close(fd);
+        return -1;
+    }
+    while((left = deadline - co_time()) > 0){
+        if(want < 0){
+            n = co_read(fd, prefix + got, 2 - got, left);
+            if(n <= 0){
+                break;
+            }
+            if((got += n) == 2){
+                want = dns_u16(prefix);
+                got = 0;
+            }
+        } else {
+            if(got == want){
+                close(fd);
+                return want;
+            }
+            n = co_read(fd, answer + got, want - got, left);
+            if(n <= 0){
+                break;
+            }
+            got += n;
+        }
+    }
+    close(fd);
+    return want >= 0 && got == want ? want : -1;
+}
+
+/*
+ * Ask every server in turn, for the configured number of rounds, until
+ * one gives a usable answer. Failures are never cached.
+ */
+static void dns_query(struct dns_entry *entry){
+    unsigned char query[DNS_UDP_SIZE], udp_answer[DNS_UDP_SIZE], *answer;
+    int qlen, attempt, server, n, status = DNS_STATUS_FAIL;
+    double ttl = 0;
+    uint16_t id = dns_random_id();
+    entry->status = DNS_STATUS_FAIL;
+    entry->naddrs = 0;
+    entry->expires = 0;
+    if((qlen = dns_encode_query(query, id, entry->name, entry->qtype)) < 0){
+        entry->status = DNS_STATUS_NONAME;
+        return;
+    }
+    for(attempt = 0; attempt < dns_config.attempts; attempt++){
+        for(server = 0; server < dns_config.nservers; server++){
+            answer = udp_answer;
+            n = dns_exchange_udp((struct sockaddr *)&dns_config.servers[server], dns_config.server_lens[server], query, qlen, answer, dns_config.timeout);
+            /* Cancelled, or past the deadline of the coroutine: stop asking. */
+            if(n < 0 && (errno == ECANCELED || (co_get_deadline() > 0 && co_time() >= co_get_deadline()))){
+                return;
+            }
+            if(n < 0 || (status = dns_parse_response(answer, n, id, entry->qtype, entry, &ttl)) < 0){
+                continue;
+            }
+            if(status == DNS_STATUS_TRUNCATED){
+                if(!(answer = malloc(DNS_TCP_SIZE))){
+                    return;
+                }
+                n = dns_exchange_tcp((struct sockaddr *)&dns_config.servers[server], dns_config.server_lens[server], query, qlen, answer, dns_config.timeout);
+                status = n < 0 ? -1 : dns_parse_response(answer, n, id, entry->qtype, entry, &ttl);
+                free(answer);
+                if(status < 0 || status == DNS_STATUS_TRUNCATED){
+                    continue;
+                }
+            }
+            if(status == DNS_STATUS_OK || status == DNS_STATUS_NONAME){
+                entry->status = status;
+                entry->expires = co_time() + ttl;
+                return;
+            }
+        }
+    }
+}
+
+static void dns_resolve(const char *name, int qtype, struct dns_result *result){
+    struct dns_entry *entry = dns_cache_find(name, qtype);
+    memset(result, 0, sizeof(struct dns_result));
+    if(entry && entry->state == DNS_STATE_PENDING){
+        entry->waiters += 1;
+        co_mutex_lock(dns_mutex);
+        while(entry->state == DNS_STATE_PENDING){
+            if(co_cond_wait(dns_cond, dns_mutex, -1) < 0){
+                break;
+            }
+        }
+        co_mutex_unlock(dns_mutex);
+        entry->waiters -= 1;
+        if(entry->state == DNS_STATE_PENDING){
+            result->status = DNS_STATUS_FAIL;
+            return;
+        }
+    } else if(!entry || entry->expires <= co_time()){
+        if(!entry && !(entry = dns_cache_insert(name, qtype))){
+            result->status = DNS_STATUS_FAIL;
+            return;
+        }
+        entry->state = DNS_STATE_PENDING;
+        dns_query(entry);
+        entry->state = DNS_STATE_DONE;
+        co_cond_broadcast(dns_cond);
+    }
+    result->status = entry->status;
+    result->naddrs = entry->naddrs;
+    memcpy(result->addrs, entry->addrs, entry->naddrs * sizeof(struct dns_addr));
+    strcpy(result->canonname, entry->canonname);
+}
+
+static void dns_release_job(struct dns_job *job){
+    if(!--job->refs){
+        free(job);
+    }
+}
+
+static void dns_lookup_routine(void *arg){
+    struct dns_job *job = arg;
+    dns_resolve(job->name, job->qtype, &(job->result));
+    dns_release_job(job);
+}
+
+/*
+ * Resolve one candidate name for the families asked for; with AF_UNSPEC
+ * the A and AAAA queries run side by side.
+ */
+static int dns_lookup_name(const char *name, int family, struct dns_result *v4, struct dns_result *v6){
+    struct dns_job *job = NULL;
+    int64_t co_id = 0;
+    v4->status = v6->status = DNS_STATUS_NONAME;
+    v4->naddrs = v6->naddrs = 0;
+    if(family == AF_UNSPEC && (job = calloc(1, sizeof(struct dns_job)))){
+        strcpy(job->name, name);
+        job->qtype = DNS_TYPE_AAAA;
+        job->refs = 2;
+        if((co_id = co_make(DNS_LOOKUP_STACK_SIZE, dns_lookup_routine, job)) < 0){
+            free(job);
+            job = NULL;
+        }
+    }
+    if(family == AF_UNSPEC || family == AF_INET){
+        dns_resolve(name, DNS_TYPE_A, v4);
+    }
+    if(job){
+        if(co_join(co_id, -1) < 0 && errno != ESRCH){
+            dns_release_job(job);
+            return -1;
+        }
+        *v6 = job->result;
+        dns_release_job(job);
+    } else if(family == AF_UNSPEC || family == AF_INET6){
+        dns_resolve(name, DNS_TYPE_AAAA, v6);
+    }
+    return 0;
+}
+
+static int dns_service_port(const char *service, int socktype, int flags, int *port){
+    char *end;
+    long value;
+    struct servent servent, *result;
+    char buf[1024];
+    *port = 0;
+    if(!service){
+        return 0;
+    }
+    value = strtol(service, &end, 10);
+    if(*service && !*end){
+        if(value < 0 || value > 65535){
+            return EAI_SERVICE;
+        }
+        *port = value;
+        return 0;
+    }
+    if(flags & AI_NUMERICSERV){
+        return EAI_NONAME;
+    }
+    if(getservbyname_r(service, socktype == SOCK_DGRAM ? "udp" : "tcp", &servent, buf, sizeof(buf), &result) || !result){
+        return EAI_SERVICE;
+    }
+    *port = ntohs(result->s_port);
+    return 0;
+}
+
+static int dns_append(struct addrinfo ***tail, const struct dns_addr *addr, int port, int socktype, int protocol){
+    struct addrinfo *ai = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    if(!ai){
+        return -1;
+    }
+    ai->ai_family = addr->family;
+    ai->ai_socktype = socktype;
+    ai->ai_protocol = protocol ? protocol : (socktype == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP);
+    ai->ai_addr = (struct sockaddr *)(ai + 1);
+    if(addr->family == AF_INET){
+        sin = (struct sockaddr_in *)ai->ai_addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr = addr->addr.v4;
+        ai->ai_addrlen = sizeof(struct sockaddr_in);
+    } else {
+        sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_addr = addr->addr.v6;
+        ai->ai_addrlen = sizeof(struct sockaddr_in6);
+    }
+    **tail = ai;
+    *tail = &(ai->ai_next);
+    return 0;
+}
+
+int co_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res){
+    struct addrinfo default_hints, *head = NULL, **tail = &head;
+    struct dns_result v4, v6;
+    struct dns_addr addrs[2 * DNS_MAX_ADDRS];
+    char name[DNS_MAX_NAME], canonname[DNS_MAX_NAME];
+    int i, j, naddrs = 0, port, ret, dots = 0, nsocktypes, found = 0, failed = 0, candidate, ncandidates;
+    int socktypes[2];
+    const char *p;
+    if(!co_in_coroutine()){
+        return getaddrinfo(node, service, hints, res);
+    }
+    if(!hints){
+        memset(&default_hints, 0, sizeof(default_hints));
+        default_hints.ai_family = AF_UNSPEC;
+        hints = &default_hints;
+    }
+    if(hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET && hints->ai_family != AF_INET6){
+        return EAI_FAMILY;
+    }
+    if(hints->ai_socktype && hints->ai_socktype != SOCK_STREAM && hints->ai_socktype != SOCK_DGRAM){
+        return EAI_SOCKTYPE;
+    }
+    if(!node && !service){
+        return EAI_NONAME;
+    }
+    if((ret = dns_service_port(service, hints->ai_socktype, hints->ai_flags, &port))){
+        return ret;
+    }
+    canonname[0] = '\0';
+    if(!node){
+        if(hints->ai_family != AF_INET){
+            addrs[naddrs].family = AF_INET6;
+            addrs[naddrs++].addr.v6 = (hints->ai_flags & AI_PASSIVE) ? in6addr_any : in6addr_loopback;
+        }
+        if(hints->ai_family != AF_INET6){
+            addrs[naddrs].family = AF_INET;
+            addrs[naddrs++].addr.v4.s_addr = htonl((hints->ai_flags & AI_PASSIVE) ? INADDR_ANY : INADDR_LOOPBACK);
+        }
+    } else if(hints->ai_family != AF_INET6 && inet_pton(AF_INET, node, &addrs[0].addr.v4) == 1){
+        addrs[naddrs++].family = AF_INET;
+        strcpy(canonname, node);
+    } else if(hints->ai_family != AF_INET && inet_pton(AF_INET6, node, &addrs[0].addr.v6) == 1){
+        addrs[naddrs++].family = AF_INET6;
+        strcpy(canonname, node);
+    } else if(hints->ai_flags & AI_NUMERICHOST || strlen(node) >= DNS_MAX_NAME - 1 || !node[0] || node[0] == '.' || strstr(node, "..")){
+        /* An empty label, as in "", "." or "a..b", never makes a valid query. */
+        return EAI_NONAME;
+    } else {
+        if(!dns_mutex){
+            dns_mutex = co_mutex_create();
+            dns_cond = co_cond_create();
+            if(!dns_mutex || !dns_cond){
+                return EAI_MEMORY;
+            }
+        }
+        dns_load_config();
+        if(hints->ai_family != AF_INET6){
+            dns_hosts_lookup(node, AF_INET, &v4);
+            for(i = 0; i < v4.naddrs; i++){
+                addrs[naddrs++] = v4.addrs[i];
+            }
+        }
+        if(hints->ai_family != AF_INET){
+            dns_hosts_lookup(node, AF_INET6, &v6);
+            for(i = 0; i < v6.naddrs; i++){
+                addrs[naddrs++] = v6.addrs[i];
+            }
+        }
+        if(naddrs){
+            strcpy(canonname, node);
+        }
+        /*
+         * As in glibc: a name with a trailing dot is absolute, a name with
+         * at least ndots dots is tried as is before the search domains,
+         * any other name after them.
+         */
+        for(p = node; *p; p++){
+            dots += *p == '.';
+        }
+        ncandidates = node[strlen(node) - 1] == '.' ? 1 : dns_config.nsearch + 1;
+        for(candidate = 0; !naddrs && candidate < ncandidates; candidate++){
+            i = dots >= dns_config.ndots ? candidate - 1 : candidate;
+            if(ncandidates == 1 || i < 0 || i == dns_config.nsearch){
+                snprintf(name, sizeof(name), "%s", node);
+            } else if(snprintf(name, sizeof(name), "%s.%s", node, dns_config.search[i]) >= (int)sizeof(name)){
+                continue;
+            }
+            if(name[strlen(name) - 1] == '.'){
+                name[strlen(name) - 1] = '\0';
+            }
+            for(j = 0; name[j]; j++){
+                name[j] = tolower((unsigned char)name[j]);
+            }
+            if(dns_lookup_name(name, hints->ai_family, &v4, &v6) < 0){
+                return EAI_SYSTEM;
+            }
+            for(i = 0; i < v4.naddrs; i++){
+                addrs[naddrs++] = v4.addrs[i];
+            }
+            for(i = 0; i < v6.naddrs; i++){
+                addrs[naddrs++] = v6.addrs[i];
+            }
+            found |= v4.status == DNS_STATUS_NONAME || v6.status == DNS_STATUS_NONAME;
+            failed |= v4.status == DNS_STATUS_FAIL || v6.status == DNS_STATUS_FAIL;
+            if(naddrs){
+                strcpy(canonname, v4.naddrs ? v4.canonname : v6.canonname);
+            }
+        }
+        if(!naddrs){
+            return failed && !found ? EAI_AGAIN : EAI_NONAME;
+        }
+    }
+    nsocktypes = 0;
+    if(hints->ai_socktype != SOCK_DGRAM){
+        socktypes[nsocktypes++] = SOCK_STREAM;
+    }
+    if(hints->ai_socktype != SOCK_STREAM){
+        socktypes[nsocktypes++] = SOCK_DGRAM;
+    }
+    for(i = 0; i < naddrs; i++){
+        for(j = 0; j < nsocktypes; j++){
+            if(dns_append(&tail, &addrs[i], port, socktypes[j], hints->ai_protocol) < 0){
+                co_freeaddrinfo(head);
+                return EAI_MEMORY;
+            }
+        }
+    }
+    if(hints->ai_flags & AI_CANONNAME && head && !(head->ai_canonname = strdup(canonname[0] ? canonname : node))){
+        co_freeaddrinfo(head);
+        return EAI_MEMORY;
+    }
+    *res = head;
+    return 0;
+}
+
+/*
+ * Same layout as glibc: the socket address lives in the block of its
+ * addrinfo and only ai_canonname is allocated apart.
+ */
+void co_freeaddrinfo(struct addrinfo *res){
+    struct addrinfo *next;
+    while(res){
+        next = res->ai_next;
+        free(res->ai_canonname);
+        free(res);
+        res = next;
+    }
+}
+
+int co_set_resolv_conf(const char *resolv_conf, const char *hosts){
+    if((resolv_conf && strlen(resolv_conf) >= PATH_MAX) || (hosts && strlen(hosts) >= PATH_MAX)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(dns_config.resolv_conf_path, resolv_conf ? resolv_conf : DNS_RESOLV_CONF);
+    strcpy(dns_config.hosts_path, hosts ? hosts : DNS_HOSTS);
+    dns_config.attempts = 0;
+    free(dns_config.hosts);
+    dns_config.hosts = NULL;
+    dns_config.nhosts = 0;
+    dns_config.checked_at = -DNS_CONF_CHECK_INTERVAL;
+    dns_cache_flush();
+    return 0;
+}
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "ring_channel.h"
+#include "event_loop.h"
+
+struct ring_channel *ring_channel_create(int msgsize, int maxmsg);
+struct ring_channel *ring_channel_open_shared(const char *name, int msgsize, int maxmsg);
+void ring_channel_destroy(struct ring_channel *ring);
+static inline struct ring_channel_slot *ring_channel_slot(struct ring_channel_shared *shared, uint64_t pos);
+static inline int ring_channel_futex_wait(struct ring_channel *ring, uint32_t val, struct timespec *deadline);
+static inline void ring_channel_futex_wake(struct ring_channel *ring);
+static inline int ring_channel_remaining(struct timespec *deadline, struct timespec *remaining);
+static inline void ring_channel_deadline(double timeout, struct timespec *deadline);
+static inline void ring_channel_signal(struct ring_channel *ring);
+static size_t ring_channel_layout(int msgsize, int maxmsg, uint32_t *capacity, uint32_t *slot_size);
+static void ring_channel_init_shared(struct ring_channel_shared *shared, int msgsize, uint32_t capacity, uint32_t slot_size);
+static struct ring_channel *ring_channel_alloc(struct ring_channel_shared *shared, size_t map_size, int futex_private);
+static void *ring_channel_bridge(void *arg);
+
+static inline struct ring_channel_slot *ring_channel_slot(struct ring_channel_shared *shared, uint64_t pos){
+    return (struct ring_channel_slot *)((char *)shared + sizeof(struct ring_channel_shared) + (pos & shared->mask) * shared->slot_size);
+}
+
+static size_t ring_channel_layout(int msgsize, int maxmsg, uint32_t *capacity, uint32_t *slot_size){
+    *capacity = 1;
+    while(*capacity < (uint32_t)maxmsg){
+        *capacity <<= 1;
+    }
+    *slot_size = sizeof(struct ring_channel_slot) + msgsize;
+    *slot_size = (*slot_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    return sizeof(struct ring_channel_shared) + (size_t)(*capacity) * (*slot_size);
+}
+
+static void ring_channel_init_shared(struct ring_channel_shared *shared, int msgsize, uint32_t capacity, uint32_t slot_size){
+    uint32_t i;
+    shared->msgsize = msgsize;
+    shared->maxmsg = capacity;
+    shared->slot_size = slot_size;
+    shared->mask = capacity - 1;
+    for(i = 0; i < capacity; i++){
+        ring_channel_slot(shared, i)->sequence = i;
+    }
+    __atomic_store_n(&(shared->magic), RING_CHANNEL_MAGIC, __ATOMIC_RELEASE);
+}
+
+static struct ring_channel *ring_channel_alloc(struct ring_channel_shared *shared, size_t map_size, int futex_private){
+    struct ring_channel *ring = calloc(1, sizeof(struct ring_channel));
+    if(!ring){
+        return NULL;
+    }
+    ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->eventfd < 0){
+        free(ring);
+        return NULL;
+    }
+    ring->shared = shared;
+    ring->map_size = map_size;
+    ring->futex_private = futex_private;
+    ring->spin = RING_CHANNEL_DEFAULT_SPIN;
+    INIT_LIST_HEAD(&(ring->ev_node));
+    INIT_LIST_HEAD(&(ring->receive_list));
+    INIT_LIST_HEAD(&(ring->send_list));
+    return ring;
+}
+
+struct ring_channel *ring_channel_create(int msgsize, int maxmsg){
+    struct ring_channel *ring;
+    struct ring_channel_shared *shared;
+    uint32_t capacity, slot_size;
+    size_t map_size;
+    if(msgsize <= 0 || maxmsg <= 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    map_size = ring_channel_layout(msgsize, maxmsg, &capacity, &slot_size);
+    shared = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(shared == MAP_FAILED){
+        return NULL;
+    }
+    ring_channel_init_shared(shared, msgsize, capacity, slot_size);
+    ring = ring_channel_alloc(shared, map_size, 1);
+    if(!ring){
+        munmap(shared, map_size);
+    }
+    return ring;
+}
+
+/*
+ * The first process to open the name creates and initializes the ring;
+ * later ones map it and wait for the magic to be published. The msgsize
+ * and maxmsg of an existing ring win, as with channel_open(). A creator
+ * which died half way leaves the ring unpublished, so the wait gives up
+ * with ETIMEDOUT after RING_CHANNEL_OPEN_TIMEOUT seconds.
+ */
+struct ring_channel *ring_channel_open_shared(const char *name, int msgsize, int maxmsg){
+    struct ring_channel *ring;
+    struct ring_channel_shared *shared;
+    struct stat st;
+    struct timespec deadline, remaining;
+    uint32_t capacity, slot_size;
+    size_t map_size;
+    int fd, creator = 1, saved_errno;
+    if(msgsize <= 0 || maxmsg <= 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    map_size = ring_channel_layout(msgsize, maxmsg, &capacity, &slot_size);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd < 0 && errno == EEXIST){
+        creator = 0;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    }
+    if(fd < 0){
+        return NULL;
+    }
+    if(creator){
+        if(ftruncate(fd, map_size) < 0){
+            saved_errno = errno;
+            close(fd);
+            shm_unlink(name);
+            errno = saved_errno;
+            return NULL;
+        }
+    } else {
+        ring_channel_deadline(RING_CHANNEL_OPEN_TIMEOUT, &deadline);
+        for(;;){
+            if(fstat(fd, &st) < 0){
+                saved_errno = errno;
+                close(fd);
+                errno = saved_errno;
+                return NULL;
+            }
+            if(st.st_size >= (off_t)sizeof(struct ring_channel_shared)){
+                break;
+            }
+            if(!ring_channel_remaining(&deadline, &remaining)){
+                close(fd);
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+            usleep(1000);
+        }
+        map_size = st.st_size;
+    }
+    shared = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if(shared == MAP_FAILED){
+        errno = saved_errno;
+        return NULL;
+    }
+    if(creator){
+        ring_channel_init_shared(shared, msgsize, capacity, slot_size);
+    } else {
+        while(__atomic_load_n(&(shared->magic), __ATOMIC_ACQUIRE) != RING_CHANNEL_MAGIC){
+            if(!ring_channel_remaining(&deadline, &remaining)){
+                munmap(shared, map_size);
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+            usleep(1000);
+        }
+    }
+    ring = ring_channel_alloc(shared, map_size, 0);
+    if(!ring){
+        munmap(shared, map_size);
+    }
+    return ring;
+}
+
+void ring_channel_destroy(struct ring_channel *ring){
+    if(ring->bridge_running){
+        __atomic_store_n(&(ring->bridge_stop), 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &(ring->co_waiters), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        ring_channel_futex_wake(ring);
+        pthread_join(ring->bridge_thread, NULL);
+    }
+    if(ring->ev){
+        ring->ev->remove_reader(ring->ev, ring->eventfd, ring);
+        list_del(&(ring->ev_node));
+    }
+    close(ring->eventfd);
+    munmap(ring->shared, ring->map_size);
+    free(ring);
+}
+
+/*
+ * Other processes can't write our eventfd, so a ring in shared memory gets a
+ * bridge thread which sleeps on the seq futex while coroutines of this
+ * process are parked and forwards every change to the eventfd.
+ */
+static void *ring_channel_bridge(void *arg){
+    struct ring_channel *ring = arg;
+    uint32_t seq;
+    while(!__atomic_load_n(&(ring->bridge_stop), __ATOMIC_SEQ_CST)){
+        if(!__atomic_load_n(&(ring->co_waiters), __ATOMIC_SEQ_CST)){
+            syscall(SYS_futex, &(ring->co_waiters), FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+            continue;
+        }
+        seq = __atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST);
+        ring_channel_signal(ring);
+        __atomic_add_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST) == seq && !__atomic_load_n(&(ring->bridge_stop), __ATOMIC_SEQ_CST)){
+            ring_channel_futex_wait(ring, seq, NULL);
+        }
+        __atomic_sub_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+int ring_channel_add_waiter(struct ring_channel *ring){
+    if(!ring->futex_private && !ring->bridge_running){
+        if(pthread_create(&(ring->bridge_thread), NULL, ring_channel_bridge, ring)){
+            errno = EAGAIN;
+            return -1;
+        }
+        ring->bridge_running = 1;
+    }
+    if(__atomic_add_fetch(&(ring->co_waiters), 1, __ATOMIC_SEQ_CST) == 1 && !ring->futex_private){
+        syscall(SYS_futex, &(ring->co_waiters), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+void ring_channel_del_waiter(struct ring_channel *ring){
+    __atomic_sub_fetch(&(ring->co_waiters), 1, __ATOMIC_SEQ_CST);
+}
+
+void ring_channel_set_spin(struct ring_channel *ring, int spin){
+    ring->spin = spin;
+}
+
+ssize_t ring_channel_try_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len){
+    struct ring_channel_shared *shared = ring->shared;
+    struct ring_channel_slot *slot;
+    uint64_t pos, sequence;
+    int64_t diff;
+    if(msg_len > shared->msgsize){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    pos = __atomic_load_n(&(shared->enqueue_pos), __ATOMIC_RELAXED);
+    for(;;){
+        slot = ring_channel_slot(shared, pos);
+        sequence = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+        diff = (int64_t)sequence - (int64_t)pos;
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&(shared->enqueue_pos), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        } else if(diff < 0){
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&(shared->enqueue_pos), __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(slot->data, msg_ptr, msg_len);
+    slot->len = msg_len;
+    __atomic_store_n(&(slot->sequence), pos + 1, __ATOMIC_RELEASE);
+    return msg_len;
+}
+
+ssize_t ring_channel_try_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len){
+    struct ring_channel_shared *shared = ring->shared;
+    struct ring_channel_slot *slot;
+    uint64_t pos, sequence;
+    int64_t diff;
+    ssize_t data_len;
+    if(msg_len < shared->msgsize){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    pos = __atomic_load_n(&(shared->dequeue_pos), __ATOMIC_RELAXED);
+    for(;;){
+        slot = ring_channel_slot(shared, pos);
+        sequence = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+        diff = (int64_t)sequence - (int64_t)(pos + 1);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&(shared->dequeue_pos), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        } else if(diff < 0){
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&(shared->dequeue_pos), __ATOMIC_RELAXED);
+        }
+    }
+    data_len = slot->len;
+    memcpy(msg_ptr, slot->data, data_len);
+    __atomic_store_n(&(slot->sequence), pos + shared->mask + 1, __ATOMIC_RELEASE);
+    return data_len;
+}
+
+/*
+ * Called after every successful send or receive. Blocked threads sleep on
+ * the seq futex, blocked coroutines on the eventfd; the eventfd is only
+ * written once until the event loop drains it.
+ */
+void ring_channel_notify(struct ring_channel *ring){
+    __atomic_add_fetch(&(ring->shared->seq), 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(ring->shared->waiters), __ATOMIC_SEQ_CST)){
+        ring_channel_futex_wake(ring);
+    }
+    if(__atomic_load_n(&(ring->co_waiters), __ATOMIC_SEQ_CST)){
+        ring_channel_signal(ring);
+    }
+}
+
+static inline void ring_channel_signal(struct ring_channel *ring){
+    uint64_t one = 1;
+    int saved_errno = errno;
+    if(!__atomic_exchange_n(&(ring->signaled), 1, __ATOMIC_SEQ_CST)){
+        while(write(ring->eventfd, &one, sizeof(one)) < 0 && errno == EINTR){
+        }
+    }
+    errno = saved_errno;
+}
+
+static inline int ring_channel_futex_wait(struct ring_channel *ring, uint32_t val, struct timespec *deadline){
+    struct timespec remaining;
+    if(deadline && !ring_channel_remaining(deadline, &remaining)){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return syscall(SYS_futex, &(ring->shared->seq), ring->futex_private ? FUTEX_WAIT_PRIVATE : FUTEX_WAIT, val, deadline ? &remaining : NULL, NULL, 0);
+}
+
+static inline void ring_channel_futex_wake(struct ring_channel *ring){
+    syscall(SYS_futex, &(ring->shared->seq), ring->futex_private ? FUTEX_WAKE_PRIVATE : FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void ring_channel_deadline(double timeout, struct timespec *deadline){
+    int integer_seconds = (int)(timeout);
+    long nano_seconds = (long)((timeout - integer_seconds)* 1000000000);
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += integer_seconds;
+    deadline->tv_nsec += nano_seconds;
+    while(deadline->tv_nsec >= 1000000000){
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static inline int ring_channel_remaining(struct timespec *deadline, struct timespec *remaining){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if(remaining->tv_nsec < 0){
+        remaining->tv_sec -= 1;
+        remaining->tv_nsec += 1000000000;
+    }
+    return remaining->tv_sec >= 0;
+}
+
+int ring_channel_thread_send(struct ring_channel *ring, const char *msg_ptr, size_t msg_len, double timeout){
+    struct timespec deadline, remaining;
+    uint32_t seq;
+    int ret, spin;
+    if(timeout > 0){
+        ring_channel_deadline(timeout, &deadline);
+    }
+    for(;;){
+        for(spin = 0;; spin++){
+            seq = __atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST);
+            if((ret = ring_channel_try_send(ring, msg_ptr, msg_len)) >= 0){
+                ring_channel_notify(ring);
+                return ret;
+            }
+            if(errno != EAGAIN || timeout == 0){
+                return -1;
+            }
+            if(timeout > 0 && !ring_channel_remaining(&deadline, &remaining)){
+                errno = 0;
+                return 0;
+            }
+            if(ring->spin >= 0 && spin >= ring->spin){
+                break;
+            }
+            __builtin_ia32_pause();
+        }
+        __atomic_add_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST) == seq){
+            ring_channel_futex_wait(ring, seq, timeout > 0 ? &deadline : NULL);
+        }
+        __atomic_sub_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+int ring_channel_thread_receive(struct ring_channel *ring, char *msg_ptr, size_t msg_len, double timeout){
+    struct timespec deadline, remaining;
+    uint32_t seq;
+    int ret, spin;
+    if(timeout > 0){
+        ring_channel_deadline(timeout, &deadline);
+    }
+    for(;;){
+        for(spin = 0;; spin++){
+            seq = __atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST);
+            if((ret = ring_channel_try_receive(ring, msg_ptr, msg_len)) >= 0){
+                ring_channel_notify(ring);
+                return ret;
+            }
+            if(errno != EAGAIN || timeout == 0){
+                return -1;
+            }
+            if(timeout > 0 && !ring_channel_remaining(&deadline, &remaining)){
+                errno = 0;
+                return 0;
+            }
+            if(ring->spin >= 0 && spin >= ring->spin){
+                break;
+            }
+            __builtin_ia32_pause();
+        }
+        __atomic_add_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&(ring->shared->seq), __ATOMIC_SEQ_CST) == seq){
+            ring_channel_futex_wait(ring, seq, timeout > 0 ? &deadline : NULL);
+        }
+        __atomic_sub_fetch(&(ring->shared->waiters), 1, __ATOMIC_SEQ_CST);
+    }
+}
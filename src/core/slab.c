@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include "slab.h"
+
+void slab_cache_init(struct slab_cache *cache, size_t object_size, size_t objects_per_block);
+void slab_cache_destroy(struct slab_cache *cache);
+int slab_cache_grow(struct slab_cache *cache);
+
+void slab_cache_init(struct slab_cache *cache, size_t object_size, size_t objects_per_block){
+    memset(cache, 0, sizeof(struct slab_cache));
+    if(object_size < sizeof(struct slab_free_object)){
+        object_size = sizeof(struct slab_free_object);
+    }
+    cache->object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    cache->objects_per_block = objects_per_block ? objects_per_block : SLAB_DEFAULT_OBJECTS;
+}
+
+void slab_cache_destroy(struct slab_cache *cache){
+    struct slab_block *block, *next;
+    for(block = cache->blocks; block; block = next){
+        next = block->next;
+        free(block);
+    }
+    cache->blocks = NULL;
+    cache->free_list = NULL;
+    cache->in_use = cache->free_objects = cache->block_bytes = 0;
+}
+
+int slab_cache_grow(struct slab_cache *cache){
+    size_t i, size = sizeof(struct slab_block) + cache->object_size * cache->objects_per_block;
+    struct slab_block *block = malloc(size);
+    struct slab_free_object *object;
+    char *objects;
+    if(!block){
+        return -1;
+    }
+    block->next = cache->blocks;
+    cache->blocks = block;
+    cache->block_bytes += size;
+    objects = (char *)(block + 1);
+    for(i = cache->objects_per_block; i > 0; i--){
+        object = (struct slab_free_object *)(objects + (i - 1) * cache->object_size);
+        object->next = cache->free_list;
+        cache->free_list = object;
+    }
+    cache->free_objects += cache->objects_per_block;
+    return 0;
+}
@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "coroutine.h"
+
+/*
+ * Preloadable shim (LD_PRELOAD=libmookry_hook.so) which turns the blocking
+ * libc calls of unmodified code into coroutine waits. A socket the calling
+ * code believes to be blocking is switched to O_NONBLOCK behind its back;
+ * on EAGAIN the hook parks the coroutine with co_select() and retries, or,
+ * outside coroutines, emulates the blocking call with poll().
+ *
+ * co_select() and the co_* functions call these very symbols themselves,
+ * so a coroutine-local flag marks that the library is running on behalf
+ * of a hook, and nested calls go straight to libc.
+ */
+
+#define HOOK_MAX_FDS 65536
+#define HOOK_FD_UNKNOWN 0
+#define HOOK_FD_SOCKET 1
+#define HOOK_FD_OTHER 2
+
+struct hook_fd {
+    int state;
+    int user_nonblock;
+    double recv_timeout;
+    double send_timeout;
+};
+
+static struct hook_fd hook_fds[HOOK_MAX_FDS];
+static int hook_key = -1;
+static int hook_ready = 0;
+
+static ssize_t (*real_read)(int fd, void *buf, size_t count);
+static ssize_t (*real_write)(int fd, const void *buf, size_t count);
+static ssize_t (*real_recv)(int sockfd, void *buf, size_t len, int flags);
+static ssize_t (*real_send)(int sockfd, const void *buf, size_t len, int flags);
+static ssize_t (*real_recvfrom)(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+static ssize_t (*real_sendto)(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
+static ssize_t (*real_recvmsg)(int sockfd, struct msghdr *msg, int flags);
+static ssize_t (*real_sendmsg)(int sockfd, const struct msghdr *msg, int flags);
+static int (*real_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+static int (*real_accept4)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+static int (*real_connect)(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+static int (*real_socket)(int domain, int type, int protocol);
+static int (*real_socketpair)(int domain, int type, int protocol, int sv[2]);
+static int (*real_dup)(int oldfd);
+static int (*real_dup2)(int oldfd, int newfd);
+static int (*real_dup3)(int oldfd, int newfd, int flags);
+static int (*real_close)(int fd);
+static int (*real_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+static int (*real_fcntl)(int fd, int cmd, ...);
+static int (*real_fcntl64)(int fd, int cmd, ...);
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+static int (*real_setsockopt)(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+static unsigned int (*real_sleep)(unsigned int seconds);
+static int (*real_usleep)(useconds_t usec);
+static int (*real_nanosleep)(const struct timespec *req, struct timespec *rem);
+static int (*real_getaddrinfo)(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+
+static void hook_init() __attribute__((constructor));
+static inline int hook_active();
+static struct hook_fd *hook_fd_state(int fd);
+static struct hook_fd *hook_begin(int fd);
+static int hook_wait(int fd, short events, double timeout);
+static int hook_fail(int timeout_errno);
+static int hook_fcntl(int (*real)(int fd, int cmd, ...), int fd, int cmd, void *arg);
+static int hook_dup_state(int oldfd, int newfd);
+
+static void hook_init(){
+    if(hook_ready){
+        return;
+    }
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_recv = dlsym(RTLD_NEXT, "recv");
+    real_send = dlsym(RTLD_NEXT, "send");
+    real_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+    real_sendto = dlsym(RTLD_NEXT, "sendto");
+    real_recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+    real_sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+    real_accept = dlsym(RTLD_NEXT, "accept");
+    real_accept4 = dlsym(RTLD_NEXT, "accept4");
+    real_connect = dlsym(RTLD_NEXT, "connect");
+    real_socket = dlsym(RTLD_NEXT, "socket");
+    real_socketpair = dlsym(RTLD_NEXT, "socketpair");
+    real_dup = dlsym(RTLD_NEXT, "dup");
+    real_dup2 = dlsym(RTLD_NEXT, "dup2");
+    real_dup3 = dlsym(RTLD_NEXT, "dup3");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_poll = dlsym(RTLD_NEXT, "poll");
+    real_fcntl = dlsym(RTLD_NEXT, "fcntl");
+    real_fcntl64 = dlsym(RTLD_NEXT, "fcntl64");
+    if(!real_fcntl64){
+        real_fcntl64 = real_fcntl;
+    }
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+    real_sleep = dlsym(RTLD_NEXT, "sleep");
+    real_usleep = dlsym(RTLD_NEXT, "usleep");
+    real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    real_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
+    co_key_create(&hook_key, NULL);
+    hook_ready = 1;
+}
+
+static inline int hook_active(){
+    if(!hook_ready){
+        hook_init();
+    }
+    return hook_key >= 0 && co_in_coroutine() && !co_getspecific(hook_key);
+}
+
+/*
+ * Files, pipes and ttys are remembered as HOOK_FD_OTHER, so they cost one
+ * fstat() per descriptor and not one per call. Every call which hands out
+ * a descriptor resets or copies its slot.
+ */
+static struct hook_fd *hook_fd_state(int fd){
+    struct hook_fd *h = &hook_fds[fd];
+    struct stat st;
+    int flags;
+    if(h->state == HOOK_FD_OTHER){
+        return NULL;
+    }
+    if(h->state == HOOK_FD_UNKNOWN){
+        if(fstat(fd, &st) < 0){
+            return NULL;
+        }
+        if(!S_ISSOCK(st.st_mode)){
+            h->state = HOOK_FD_OTHER;
+            return NULL;
+        }
+        if((flags = real_fcntl(fd, F_GETFL)) < 0){
+            return NULL;
+        }
+        h->user_nonblock = (flags & O_NONBLOCK) ? 1 : 0;
+        if(!h->user_nonblock && real_fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+            return NULL;
+        }
+        h->state = HOOK_FD_SOCKET;
+    }
+    return h;
+}
+
+/*
+ * Returns the state of fd when a call on it must be made to block, i.e.
+ * when it is a socket its user thinks is blocking. Sockets are only taken
+ * over from inside a coroutine; outside, only those already taken over
+ * need their blocking behaviour emulated.
+ */
+static struct hook_fd *hook_begin(int fd){
+    struct hook_fd *h;
+    if(fd < 0 || fd >= HOOK_MAX_FDS){
+        return NULL;
+    }
+    if(hook_active()){
+        h = hook_fd_state(fd);
+    } else if(co_in_coroutine()){
+        return NULL;
+    } else {
+        h = hook_fds[fd].state == HOOK_FD_SOCKET ? &hook_fds[fd] : NULL;
+    }
+    return h && !h->user_nonblock ? h : NULL;
+}
+
+static int hook_wait(int fd, short events, double timeout){
+    struct co_select_case select_case;
+    struct pollfd pollfd;
+    int ret;
+    if(co_in_coroutine()){
+        memset(&select_case, 0, sizeof(select_case));
+        select_case.type = (events & POLLOUT) ? CO_SELECT_WRITE : CO_SELECT_READ;
+        select_case.fd = fd;
+        co_setspecific(hook_key, (void *)1);
+        ret = co_select(&select_case, 1, timeout > 0 ? timeout : -1);
+        co_setspecific(hook_key, NULL);
+        return ret;
+    }
+    pollfd.fd = fd;
+    pollfd.events = events;
+    while((ret = real_poll(&pollfd, 1, timeout > 0 ? (int)(timeout * 1000) : -1)) < 0 && errno == EINTR){
+    }
+    if(ret == 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static int hook_fail(int timeout_errno){
+    if(errno == ETIMEDOUT){
+        errno = timeout_errno;
+    }
+    return -1;
+}
+
+ssize_t read(int fd, void *buf, size_t count){
+    struct hook_fd *h = hook_begin(fd);
+    ssize_t ret;
+    while((ret = real_read(fd, buf, count)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(fd, POLLIN, h->recv_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count){
+    struct hook_fd *h = hook_begin(fd);
+    ssize_t ret;
+    while((ret = real_write(fd, buf, count)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(fd, POLLOUT, h->send_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_recv(sockfd, buf, len, flags)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLIN, h->recv_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_send(sockfd, buf, len, flags)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLOUT, h->send_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_recvfrom(sockfd, buf, len, flags, src_addr, addrlen)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLIN, h->recv_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_sendto(sockfd, buf, len, flags, dest_addr, addrlen)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLOUT, h->send_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_recvmsg(sockfd, msg, flags)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLIN, h->recv_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags){
+    struct hook_fd *h = (flags & MSG_DONTWAIT) ? NULL : hook_begin(sockfd);
+    ssize_t ret;
+    while((ret = real_sendmsg(sockfd, msg, flags)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLOUT, h->send_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    return ret;
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen){
+    return accept4(sockfd, addr, addrlen, 0);
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags){
+    struct hook_fd *h = hook_begin(sockfd);
+    int ret;
+    while((ret = real_accept4(sockfd, addr, addrlen, flags)) < 0 && errno == EAGAIN && h){
+        if(hook_wait(sockfd, POLLIN, h->recv_timeout) < 0){
+            return hook_fail(EAGAIN);
+        }
+    }
+    if(ret >= 0 && ret < HOOK_MAX_FDS){
+        memset(&hook_fds[ret], 0, sizeof(struct hook_fd));
+    }
+    return ret;
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
+    struct hook_fd *h = hook_begin(sockfd);
+    int ret, optval = 0;
+    socklen_t optlen = sizeof(optval);
+    ret = real_connect(sockfd, addr, addrlen);
+    if(ret == 0 || errno != EINPROGRESS || !h){
+        return ret;
+    }
+    if(hook_wait(sockfd, POLLOUT, h->send_timeout) < 0){
+        return hook_fail(EINPROGRESS);
+    }
+    if(getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen) < 0){
+        return -1;
+    }
+    if(optval){
+        errno = optval;
+        return -1;
+    }
+    return 0;
+}
+
+int socket(int domain, int type, int protocol){
+    int ret;
+    if(!hook_ready){
+        hook_init();
+    }
+    ret = real_socket(domain, type, protocol);
+    if(ret >= 0 && ret < HOOK_MAX_FDS){
+        memset(&hook_fds[ret], 0, sizeof(struct hook_fd));
+    }
+    return ret;
+}
+
+int socketpair(int domain, int type, int protocol, int sv[2]){
+    int ret;
+    if(!hook_ready){
+        hook_init();
+    }
+    ret = real_socketpair(domain, type, protocol, sv);
+    if(ret == 0){
+        hook_dup_state(-1, sv[0]);
+        hook_dup_state(-1, sv[1]);
+    }
+    return ret;
+}
+
+/*
+ * A duplicate shares the open file description, O_NONBLOCK and socket
+ * timeouts included, so it takes over the state of the original; without
+ * that, a reused slot would keep whatever the last fd with its number had.
+ */
+static int hook_dup_state(int oldfd, int newfd){
+    if(newfd >= 0 && newfd < HOOK_MAX_FDS){
+        if(oldfd >= 0 && oldfd < HOOK_MAX_FDS){
+            hook_fds[newfd] = hook_fds[oldfd];
+        } else {
+            memset(&hook_fds[newfd], 0, sizeof(struct hook_fd));
+        }
+    }
+    return newfd;
+}
+
+int dup(int oldfd){
+    if(!hook_ready){
+        hook_init();
+    }
+    return hook_dup_state(oldfd, real_dup(oldfd));
+}
+
+int dup2(int oldfd, int newfd){
+    if(!hook_ready){
+        hook_init();
+    }
+    return hook_dup_state(oldfd, real_dup2(oldfd, newfd));
+}
+
+int dup3(int oldfd, int newfd, int flags){
+    if(!hook_ready){
+        hook_init();
+    }
+    return hook_dup_state(oldfd, real_dup3(oldfd, newfd, flags));
+}
+
+int close(int fd){
+    if(!hook_ready){
+        hook_init();
+    }
+    if(fd >= 0 && fd < HOOK_MAX_FDS){
+        memset(&hook_fds[fd], 0, sizeof(struct hook_fd));
+    }
+    return real_close(fd);
+}
+
+/*
+ * Wait on all the fds at once through co_select(), then let poll() itself
+ * fill in revents. co_select() only reports the first ready case, which
+ * is enough to know that poll() will not block any more.
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout){
+    int ret;
+    nfds_t i, ncases = 0;
+    if(!hook_active() || timeout == 0){
+        return real_poll(fds, nfds, timeout);
+    }
+    if((ret = real_poll(fds, nfds, 0)) != 0){
+        return ret;
+    }
+    if(!nfds && timeout > 0){
+        co_sleep(timeout / 1000.0);
+        return 0;
+    }
+    struct co_select_case cases[2 * nfds];
+    memset(cases, 0, sizeof(cases));
+    for(i = 0; i < nfds; i++){
+        if(fds[i].fd < 0){
+            continue;
+        }
+        if(fds[i].events & (POLLIN | POLLPRI | POLLRDHUP)){
+            cases[ncases].type = CO_SELECT_READ;
+            cases[ncases++].fd = fds[i].fd;
+        }
+        if(fds[i].events & POLLOUT){
+            cases[ncases].type = CO_SELECT_WRITE;
+            cases[ncases++].fd = fds[i].fd;
+        }
+    }
+    if(!ncases){
+        return real_poll(fds, nfds, timeout);
+    }
+    co_setspecific(hook_key, (void *)1);
+    ret = co_select(cases, ncases, timeout > 0 ? timeout / 1000.0 : -1);
+    co_setspecific(hook_key, NULL);
+    if(ret < 0 && errno != ETIMEDOUT){
+        return -1;
+    }
+    return real_poll(fds, nfds, 0);
+}
+
+static int hook_fcntl(int (*real)(int fd, int cmd, ...), int fd, int cmd, void *arg){
+    struct hook_fd *h = (fd >= 0 && fd < HOOK_MAX_FDS && hook_fds[fd].state == HOOK_FD_SOCKET) ? &hook_fds[fd] : NULL;
+    int ret;
+    if(h && cmd == F_GETFL){
+        ret = real(fd, cmd);
+        if(ret >= 0 && !h->user_nonblock){
+            ret &= ~O_NONBLOCK;
+        }
+        return ret;
+    }
+    if(h && cmd == F_SETFL){
+        h->user_nonblock = ((long)arg & O_NONBLOCK) ? 1 : 0;
+        return real(fd, cmd, (long)arg | O_NONBLOCK);
+    }
+    if(cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC){
+        return hook_dup_state(fd, real(fd, cmd, arg));
+    }
+    return real(fd, cmd, arg);
+}
+
+int fcntl(int fd, int cmd, ...){
+    va_list ap;
+    void *arg;
+    if(!hook_ready){
+        hook_init();
+    }
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    return hook_fcntl(real_fcntl, fd, cmd, arg);
+}
+
+int fcntl64(int fd, int cmd, ...){
+    va_list ap;
+    void *arg;
+    if(!hook_ready){
+        hook_init();
+    }
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    return hook_fcntl(real_fcntl64, fd, cmd, arg);
+}
+
+int ioctl(int fd, unsigned long request, ...){
+    va_list ap;
+    void *arg;
+    if(!hook_ready){
+        hook_init();
+    }
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    if(request == FIONBIO && fd >= 0 && fd < HOOK_MAX_FDS && hook_fds[fd].state == HOOK_FD_SOCKET){
+        hook_fds[fd].user_nonblock = *(int *)arg ? 1 : 0;
+        return 0;
+    }
+    return real_ioctl(fd, request, arg);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen){
+    const struct timeval *tv = optval;
+    if(!hook_ready){
+        hook_init();
+    }
+    if(level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) && optlen >= sizeof(struct timeval) && sockfd >= 0 && sockfd < HOOK_MAX_FDS){
+        if(optname == SO_RCVTIMEO){
+            hook_fds[sockfd].recv_timeout = tv->tv_sec + tv->tv_usec / 1000000.0;
+        } else {
+            hook_fds[sockfd].send_timeout = tv->tv_sec + tv->tv_usec / 1000000.0;
+        }
+    }
+    return real_setsockopt(sockfd, level, optname, optval, optlen);
+}
+
+unsigned int sleep(unsigned int seconds){
+    if(!hook_active()){
+        return real_sleep(seconds);
+    }
+    co_sleep(seconds);
+    return 0;
+}
+
+int usleep(useconds_t usec){
+    if(!hook_active()){
+        return real_usleep(usec);
+    }
+    co_sleep(usec / 1000000.0);
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem){
+    if(!hook_active()){
+        return real_nanosleep(req, rem);
+    }
+    if(req->tv_nsec < 0 || req->tv_nsec >= 1000000000 || req->tv_sec < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    co_sleep(req->tv_sec + req->tv_nsec / 1000000000.0);
+    if(rem){
+        memset(rem, 0, sizeof(struct timespec));
+    }
+    return 0;
+}
+
+/*
+ * Lookups go to the resolver of the library. Its results share the
+ * layout of glibc, so the caller's freeaddrinfo() releases them.
+ */
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res){
+    int ret;
+    if(!hook_active()){
+        return real_getaddrinfo(node, service, hints, res);
+    }
+    co_setspecific(hook_key, (void *)1);
+    ret = co_getaddrinfo(node, service, hints, res);
+    co_setspecific(hook_key, NULL);
+    return ret;
+}